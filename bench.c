@@ -0,0 +1,403 @@
+/*! \file
+ * A multi-threaded benchmark for the thread-safe build of the memory
+ * allocator ("make bench").  Every thread runs the same fixed workload, and
+ * the time each allocator call takes is recorded, to report how many
+ * operations per second the threads complete together and the median and
+ * tail latency of a single operation.  Built with -DBASELINE, the same
+ * workloads run against the system's malloc() instead.
+ *
+ * The workloads are:
+ *   uniform    allocate many chunks of one size, then free them all, the way
+ *              uniform_chunks() in the tester does
+ *   random     a random mix of allocations and frees of random sizes
+ *   handoff    pairs of threads, one allocating chunks and the other freeing
+ *              them
+ *   realloc    grow a chunk step by step with realloc, then free it
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "myalloc.h"
+
+#ifdef BASELINE
+#define ALLOCATOR "glibc"
+size_t MEMORY_SIZE;
+#define init_myalloc()
+#define close_myalloc()
+#define myalloc(size) ((unsigned char *) malloc(size))
+#define myrealloc(ptr, size) ((unsigned char *) realloc(ptr, size))
+#define myfree(ptr) free(ptr)
+#else
+#define ALLOCATOR "myalloc"
+#endif
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_ITERATIONS 200000
+#define POOL_SIZE ((size_t) 1 << 30)
+#define UNIFORM_SIZE 256
+#define UNIFORM_CHUNKS 1000
+#define LIVE_BLOCKS 256
+#define MAX_BLOCK_SIZE 2000
+#define RING_SIZE 1024
+#define HANDOFF_SIZE 128
+#define REALLOC_STEP 64
+#define REALLOC_MAX (64 * 1024)
+
+
+typedef struct worker {
+  pthread_t thread;
+  unsigned int seed;
+  int iterations;
+  // latencies of every operation, in ticks of the clock below
+  unsigned int *latency;
+  int ops;
+  int failures;
+  // the other half of a producer/consumer pair, and the ring between them
+  struct worker *partner;
+  unsigned char **ring;
+  volatile long produced;
+  volatile long consumed;
+} WORKER;
+
+
+typedef struct workload {
+  const char *name;
+  void *(*run)(void *);
+} WORKLOAD;
+
+
+// Timestamp counter ticks per nanosecond, or 1 where clock_gettime() is used.
+double ticks_per_ns = 1.0;
+
+
+// Reads the cheapest clock there is: the timestamp counter on x86, and the
+// monotonic clock, in nanoseconds, anywhere else.
+static inline unsigned long long ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+
+double seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+// Works out how fast the timestamp counter runs, over a tenth of a second.
+void calibrate() {
+#if defined(__x86_64__) || defined(__i386__)
+  struct timespec pause = { 0, 100000000 };
+  double start = seconds();
+  unsigned long long first = ticks();
+  nanosleep(&pause, NULL);
+  ticks_per_ns = (ticks() - first) / ((seconds() - start) * 1e9);
+#endif
+}
+
+
+// Records how long the operation that started at "start" took.
+static inline void note(WORKER *w, unsigned long long start) {
+  unsigned long long elapsed = ticks() - start;
+  if (w->ops < 4 * w->iterations)
+    w->latency[w->ops++] = elapsed > 0xffffffffULL ? 0xffffffff : elapsed;
+}
+
+
+static inline unsigned char *timed_alloc(WORKER *w, size_t size) {
+  unsigned long long start = ticks();
+  unsigned char *p = myalloc(size);
+  note(w, start);
+  if (p == NULL)
+    w->failures++;
+  return p;
+}
+
+
+static inline void timed_free(WORKER *w, unsigned char *p) {
+  unsigned long long start = ticks();
+  myfree(p);
+  note(w, start);
+}
+
+
+// Allocates rounds of UNIFORM_CHUNKS chunks of one size and frees each round.
+void *uniform(void *arg) {
+  WORKER *w = (WORKER *) arg;
+  unsigned char *chunks[UNIFORM_CHUNKS];
+
+  for (int done = 0; done < w->iterations; done += UNIFORM_CHUNKS) {
+    for (int i = 0; i < UNIFORM_CHUNKS; i++)
+      chunks[i] = timed_alloc(w, UNIFORM_SIZE);
+    for (int i = 0; i < UNIFORM_CHUNKS; i++) {
+      if (chunks[i] != NULL)
+        timed_free(w, chunks[i]);
+    }
+  }
+  return NULL;
+}
+
+
+// Keeps up to LIVE_BLOCKS chunks alive, freeing or allocating one at random,
+// mostly small ones, like a typical heap.
+void *random_mix(void *arg) {
+  WORKER *w = (WORKER *) arg;
+  unsigned char *blocks[LIVE_BLOCKS] = { 0 };
+
+  for (int i = 0; i < w->iterations; i++) {
+    int slot = rand_r(&w->seed) % LIVE_BLOCKS;
+    if (blocks[slot] != NULL) {
+      timed_free(w, blocks[slot]);
+      blocks[slot] = NULL;
+    }
+    else {
+      int size = rand_r(&w->seed) % 4 == 0 ?
+        rand_r(&w->seed) % MAX_BLOCK_SIZE : rand_r(&w->seed) % 128;
+      blocks[slot] = timed_alloc(w, size);
+      if (blocks[slot] != NULL)
+        blocks[slot][0] = 1;
+    }
+  }
+  for (int slot = 0; slot < LIVE_BLOCKS; slot++) {
+    if (blocks[slot] != NULL)
+      myfree(blocks[slot]);
+  }
+  return NULL;
+}
+
+
+// The producer of a pair: allocates chunks and passes them on through a ring
+// buffer, yielding whenever the ring is full, so that the consumer can run
+// even on a single processor.
+void *produce(void *arg) {
+  WORKER *w = (WORKER *) arg;
+
+  for (long i = 0; i < w->iterations; i++) {
+    unsigned char *p;
+    while (i - __atomic_load_n(&w->consumed, __ATOMIC_ACQUIRE) >= RING_SIZE)
+      sched_yield();
+    p = timed_alloc(w, HANDOFF_SIZE);
+    if (p != NULL)
+      p[0] = 1;
+    w->ring[i % RING_SIZE] = p;
+    __atomic_store_n(&w->produced, i + 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+
+// The consumer of a pair: frees whatever its producer passes on.
+void *consume(void *arg) {
+  WORKER *w = (WORKER *) arg;
+  WORKER *producer = w->partner;
+
+  for (long i = 0; i < producer->iterations; i++) {
+    unsigned char *p;
+    while (__atomic_load_n(&producer->produced, __ATOMIC_ACQUIRE) <= i)
+      sched_yield();
+    p = producer->ring[i % RING_SIZE];
+    __atomic_store_n(&producer->consumed, i + 1, __ATOMIC_RELEASE);
+    if (p != NULL)
+      timed_free(w, p);
+  }
+  return NULL;
+}
+
+
+// Even threads produce and odd ones consume; an unpaired last thread
+// consumes its own chunks through the same ring.
+void *handoff(void *arg) {
+  WORKER *w = (WORKER *) arg;
+  if (w->partner == w) {
+    for (int done = 0; done < w->iterations; done += RING_SIZE / 2) {
+      for (int i = 0; i < RING_SIZE / 2; i++)
+        w->ring[i] = timed_alloc(w, HANDOFF_SIZE);
+      for (int i = 0; i < RING_SIZE / 2; i++) {
+        if (w->ring[i] != NULL)
+          timed_free(w, w->ring[i]);
+      }
+    }
+    return NULL;
+  }
+  return w->ring != NULL ? produce(arg) : consume(arg);
+}
+
+
+// Grows a chunk REALLOC_STEP bytes at a time up to REALLOC_MAX, as a buffer
+// that is appended to would, then frees it and starts over.
+void *realloc_growth(void *arg) {
+  WORKER *w = (WORKER *) arg;
+  unsigned char *p = NULL;
+  size_t size = 0;
+
+  for (int i = 0; i < w->iterations; i++) {
+    unsigned long long start;
+    unsigned char *q;
+    if (size >= REALLOC_MAX) {
+      timed_free(w, p);
+      p = NULL;
+      size = 0;
+      continue;
+    }
+    size += REALLOC_STEP;
+    start = ticks();
+    q = myrealloc(p, size);
+    note(w, start);
+    if (q == NULL) {
+      w->failures++;
+      continue;
+    }
+    p = q;
+    p[size - 1] = 1;
+  }
+  if (p != NULL)
+    myfree(p);
+  return NULL;
+}
+
+
+WORKLOAD workloads[] = {
+  { "uniform", uniform },
+  { "random", random_mix },
+  { "handoff", handoff },
+  { "realloc", realloc_growth },
+};
+#define NUM_WORKLOADS (int) (sizeof(workloads) / sizeof(WORKLOAD))
+
+
+int compare_latencies(const void *x, const void *y) {
+  unsigned int a = *(const unsigned int *) x;
+  unsigned int b = *(const unsigned int *) y;
+  return a < b ? -1 : a > b;
+}
+
+
+// Returns the latency, in nanoseconds, that a share p of the sorted
+// latencies are no slower than.
+double percentile(unsigned int *sorted, long count, double p) {
+  long index = (long) (p * count);
+  if (index >= count)
+    index = count - 1;
+  return count == 0 ? 0 : sorted[index] / ticks_per_ns;
+}
+
+
+// Runs one workload on a fresh pool with every thread at once, and prints
+// the throughput and latencies of all of their operations together.
+void bench(WORKLOAD *workload, int threads, int iterations) {
+  WORKER *workers = calloc(threads, sizeof(WORKER));
+  unsigned int *all;
+  long ops = 0;
+  int failures = 0;
+  double start;
+  double elapsed;
+
+  MEMORY_SIZE = POOL_SIZE;
+  init_myalloc();
+
+  for (int i = 0; i < threads; i++) {
+    workers[i].seed = i + 1;
+    workers[i].iterations = iterations;
+    workers[i].latency = malloc(sizeof(unsigned int) * 4 * iterations);
+    workers[i].partner = i % 2 == 0 && i + 1 < threads ? &workers[i + 1]
+                       : i % 2 == 0 ? &workers[i] : &workers[i - 1];
+    if (i % 2 == 0)
+      workers[i].ring = malloc(sizeof(unsigned char *) * RING_SIZE);
+  }
+  start = seconds();
+  for (int i = 0; i < threads; i++)
+    pthread_create(&workers[i].thread, NULL, workload->run, &workers[i]);
+  for (int i = 0; i < threads; i++)
+    pthread_join(workers[i].thread, NULL);
+  elapsed = seconds() - start;
+
+  for (int i = 0; i < threads; i++)
+    ops += workers[i].ops;
+  all = malloc(sizeof(unsigned int) * (ops > 0 ? ops : 1));
+  ops = 0;
+  for (int i = 0; i < threads; i++) {
+    memcpy(all + ops, workers[i].latency, sizeof(unsigned int) * workers[i].ops);
+    ops += workers[i].ops;
+    failures += workers[i].failures;
+    free(workers[i].latency);
+    free(workers[i].ring);
+  }
+  qsort(all, ops, sizeof(unsigned int), compare_latencies);
+
+  printf("%-10s %-8s %14.0f %9.0f %9.0f %9.0f", workload->name, ALLOCATOR,
+         ops / elapsed, percentile(all, ops, 0.5), percentile(all, ops, 0.99),
+         percentile(all, ops, 0.999));
+  if (failures)
+    printf("  (%d failed)", failures);
+  printf("\n");
+
+  free(all);
+  free(workers);
+  close_myalloc();
+}
+
+
+void usage(char *program) {
+  printf("usage: %s [-t threads] [-n iterations] [-w workload]\n", program);
+  printf("\tRuns the allocator benchmark.\n\n");
+  printf("\t-t threads sets the number of concurrent worker threads\n\n");
+  printf("\t-n iterations sets the operations performed by each thread\n\n");
+  printf("\t-w workload runs just one of the workloads: uniform, random,\n");
+  printf("\thandoff or realloc\n\n");
+}
+
+
+int main(int argc, char *argv[]) {
+  int threads = DEFAULT_THREADS;
+  int iterations = DEFAULT_ITERATIONS;
+  char *only = NULL;
+  int c;
+
+  while ((c = getopt(argc, argv, "t:n:w:h")) != -1) {
+    switch (c) {
+      case 't':
+        threads = atoi(optarg);
+        break;
+
+      case 'n':
+        iterations = atoi(optarg);
+        break;
+
+      case 'w':
+        only = optarg;
+        break;
+
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (threads < 1 || iterations < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  calibrate();
+  printf("%-10s %-8s %14s %9s %9s %9s\n", "workload", "alloc", "ops/s",
+         "p50 ns", "p99 ns", "p99.9 ns");
+  for (int i = 0; i < NUM_WORKLOADS; i++) {
+    if (only == NULL || strcmp(only, workloads[i].name) == 0)
+      bench(&workloads[i], threads, iterations);
+  }
+  return 0;
+}
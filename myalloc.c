@@ -7,255 +7,4066 @@
  * Copyright (C) California Institute of Technology, 2004-2010.
  * All rights reserved.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <sched.h>
+#ifdef MYALLOC_THREADS
+#include <pthread.h>
+#endif
 #include "myalloc.h"
 
-int * get_header(int *footer);
-int * best_fit_block(int size);
-int * get_footer(int *header);
-int * get_next_header(int *header);
-int * back_coalesce(int * header);
-void fwd_coalesce(int * header);
+/*
+ * Block sizes are rounded up to a multiple of ALIGNMENT, and every payload
+ * starts on an ALIGNMENT boundary.  The default of 16 suits any type,
+ * including max_align_t and SSE vectors; it must be a power of two of at
+ * least 16, so that the free-list links in a free block are aligned too, and
+ * the low bits of a header have room for every flag.
+ */
+#ifndef ALIGNMENT
+#define ALIGNMENT 16
+#endif
+
+/*
+ * The first header is placed HEAP_PAD bytes into the pool, so that payloads
+ * (which start just after a header) land on an ALIGNMENT boundary.
+ */
+#define HEAP_PAD (ALIGNMENT - sizeof(size_t))
+
+/*
+ * Number of segregated free-list bins.  Bin i holds free blocks whose size
+ * lies in [2^(i + 4), 2^(i + 5)); the last bin also takes everything larger.
+ * Only blocks smaller than LARGE_BLOCK_SIZE are binned.
+ */
+#define NUM_BINS 28
+
+/*
+ * Free blocks of at least this many bytes are kept in a size-ordered AVL tree
+ * instead of a bin, so that large requests get an exact best fit in O(log n).
+ * Override with -DLARGE_BLOCK_SIZE=n; it must leave room for a tree_node.
+ */
+#ifndef LARGE_BLOCK_SIZE
+#define LARGE_BLOCK_SIZE 1024
+#endif
+
+/*
+ * Links threaded through the payload of every free block, so that the free
+ * blocks of one size class form a doubly-linked list.  Both links point at
+ * the header of the neighbouring free block.
+ */
+typedef struct free_links {
+    size_t *next;
+    size_t *prev;
+} free_links;
+
+/*
+ * Node of the large-block tree, stored in the payload of a free block.  Nodes
+ * are ordered by block size, and blocks of equal size by address.  Both
+ * children point at the header of the child's block.  The pages between
+ * zero_from and zero_to, if any, were trimmed while the block was free, and
+ * read as zeros until they are written again.
+ */
+typedef struct tree_node {
+    size_t *left;
+    size_t *right;
+    int height;
+    unsigned char *zero_from;
+    unsigned char *zero_to;
+} tree_node;
+
+_Static_assert(LARGE_BLOCK_SIZE >= 2 * sizeof(size_t) + sizeof(tree_node),
+               "LARGE_BLOCK_SIZE is too small to hold a tree_node");
+
+/*
+ * Header at the start of a directly mapped block.  The size field sits where
+ * a heap block's header would, just before the payload; its size is always 0,
+ * a size no heap block has, which marks the block as mapped.  It may still
+ * carry the SAMPLED flag.
+ */
+typedef struct mapped_header {
+    size_t length;
+    /* Distance from the start of the mapping to the header. */
+    size_t offset;
+    size_t size;
+} mapped_header;
+
+/*
+ * Block sizes are multiples of ALIGNMENT, which leaves the low bits of a
+ * header free for flags.  Only free blocks have a footer.  The header and
+ * footer of a free block hold nothing but its size, since coalescing means
+ * the block before a free block is never free itself.  The heap of an arena
+ * is followed by an epilogue word, which is where the last block's PREV_FREE
+ * bit lives.
+ */
+#define BLOCK_ALLOCATED 1
+#define PREV_FREE 2
+/*
+ * Set in the word before the payload of a chunk the heap profiler sampled,
+ * which is never a slab slot, so that freeing it finds its sample.
+ */
+#define SAMPLED 4
+/*
+ * Set in the header of a block owned by a handle, which the compactor may
+ * move while it is not pinned.  The payload of such a block starts with
+ * HANDLE_PREFIX bytes holding a pointer back to its handle.
+ */
+#define MOVABLE 8
+#define HANDLE_PREFIX ALIGNMENT
+
+#if ALIGNMENT < 16
+#error "ALIGNMENT must be at least 16 to leave room for the MOVABLE flag"
+#endif
+
+/*
+ * The smallest block that can hold a header, free-list links and a footer,
+ * rounded up to a whole number of ALIGNMENT units.
+ */
+#define MIN_BLOCK_SIZE ((2 * sizeof(size_t) + sizeof(free_links) \
+                         + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1))
+
+/*
+ * Requests of up to SLAB_MAX_SIZE bytes are served from slab pages: heap
+ * blocks of exactly SLAB_SIZE bytes, aligned to SLAB_SIZE relative to the
+ * first header, that are cut into equal slots of one size class.  Slots have
+ * no boundary tags; a bitmap in the page records which of them are free.
+ */
+#ifndef SLAB_SIZE
+#define SLAB_SIZE 4096
+#endif
+#ifndef SLAB_MAX_SIZE
+#define SLAB_MAX_SIZE 256
+#endif
+
+/* Slab size classes are spaced ALIGNMENT bytes apart, so slots stay aligned. */
+#define NUM_SLAB_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)
+
+/*
+ * A class only gets its first slab page once this many ordinary blocks of that
+ * class are live, so that an occasional small object does not pin a page.
+ */
+#ifndef SLAB_MIN_LIVE
+#define SLAB_MIN_LIVE 8
+#endif
+
+/*
+ * The placement policy, chosen at compile time with -DPLACEMENT=..., decides
+ * which free block serves a request:
+ *  - BEST_FIT takes the smallest block that fits.
+ *  - FIRST_FIT takes the first block that fits in the request's bin, or else
+ *    the head of the next non-empty bin.
+ *  - NEXT_FIT is first fit, but each bin's search resumes at a roving
+ *    pointer to where the last one ended, and wraps around.
+ *  - ADDRESS_FIT is address-ordered best fit: the smallest block that fits,
+ *    and the lowest addressed one among those of equal size.
+ * The large-block tree is ordered by size and address, so in it best fit is
+ * already address-ordered; the first and next fit policies take the first
+ * block that fits on the way down from its root.
+ */
+#define BEST_FIT 0
+#define FIRST_FIT 1
+#define NEXT_FIT 2
+#define ADDRESS_FIT 3
+
+#ifndef PLACEMENT
+#define PLACEMENT BEST_FIT
+#endif
+
+/*
+ * Freed ordinary blocks of at most QUICK_MAX_SIZE bytes are not coalesced
+ * right away.  They stay marked as allocated, and go on a LIFO quick list for
+ * their exact size, so that a request for the same size gets them back
+ * without any splitting.  The quick lists are consolidated, freeing their
+ * blocks for real, when a best-fit search comes up empty; a list that grows
+ * past QUICK_COUNT blocks is consolidated on its own.  A QUICK_MAX_SIZE of 0
+ * turns quick lists off.
+ */
+#ifndef QUICK_MAX_SIZE
+#define QUICK_MAX_SIZE 512
+#endif
+#ifndef QUICK_COUNT
+#define QUICK_COUNT 32
+#endif
+
+#define NUM_QUICK_LISTS (QUICK_MAX_SIZE / ALIGNMENT + 1)
+
+/*
+ * The pool is reserved as address space only.  An arena's heap grows by
+ * committing at least COMMIT_SIZE more bytes whenever its top block, the one
+ * that ends the heap, is too small for a request.
+ */
+#ifndef COMMIT_SIZE
+#define COMMIT_SIZE (64 * 1024)
+#endif
+
+/*
+ * The size of the huge pages the default pool may be backed by, as chosen
+ * with myalloc_set_huge_pages().  A pool backed by huge pages is committed
+ * and trimmed in whole huge pages, so that trimming never splits one that is
+ * still partly in use.
+ */
+#ifndef HUGE_PAGE_SIZE
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#endif
+
+/*
+ * On a NUMA system, the arenas of the default pool are spread over the nodes,
+ * arena i on node i modulo the number of nodes, and the reservation of each
+ * is placed on its node with mbind(NUMA_POLICY).  The default prefers the
+ * node but falls back on the others when it is full; MPOL_BIND would insist.
+ */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef NUMA_POLICY
+#define NUMA_POLICY MPOL_PREFERRED
+#endif
+
+/*
+ * Requests of at least MMAP_THRESHOLD bytes get a mapping of their own
+ * outside the pool, which is unmapped again as soon as they are freed.  The
+ * threshold can be changed, or mapping turned off, with
+ * myalloc_set_mmap_threshold().
+ */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (128 * 1024)
+#endif
+
+/*
+ * When a freed block coalesces into a free block of at least TRIM_THRESHOLD
+ * bytes, the whole pages of the freed span are handed back to the system with
+ * madvise(TRIM_ADVICE), while the boundary tags stay in place.  A threshold
+ * of 0 turns this off, leaving trimming to explicit calls of myalloc_trim().
+ * TRIM_ADVICE may also be MADV_FREE, which lets the system reclaim the pages
+ * lazily.
+ */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (128 * 1024)
+#endif
+#ifndef TRIM_ADVICE
+#define TRIM_ADVICE MADV_DONTNEED
+#endif
+
+/*
+ * Diagnostics about failed requests are passed to the diagnostic hook at most
+ * once every DIAGNOSTIC_INTERVAL milliseconds by default; the ones in between
+ * are only counted, and the count is reported with the next one that goes
+ * through.
+ */
+#ifndef DIAGNOSTIC_INTERVAL
+#define DIAGNOSTIC_INTERVAL 1000
+#endif
+/* The longest diagnostic, including its terminating null. */
+#define DIAGNOSTIC_LENGTH 256
+
+/*
+ * Once started, the heap profiler samples a myalloc() about every "period"
+ * bytes, recording up to PROFILE_DEPTH frames of its stack.  It keeps at most
+ * PROFILE_MAX_SAMPLES live samples and PROFILE_MAX_STACKS distinct stacks;
+ * beyond that, samples are dropped.  Small sampled requests are rounded up to
+ * PROFILE_MIN_SIZE, past the slab classes, so that they get a block header
+ * to carry the SAMPLED flag.  While the profiler is stopped, each thread
+ * still checks whether it has started every PROFILE_RECHECK bytes.
+ */
+#ifndef PROFILE_DEPTH
+#define PROFILE_DEPTH 32
+#endif
+#ifndef PROFILE_MAX_SAMPLES
+#define PROFILE_MAX_SAMPLES 65536
+#endif
+#ifndef PROFILE_MAX_STACKS
+#define PROFILE_MAX_STACKS 16384
+#endif
+#define PROFILE_MIN_SIZE (SLAB_MAX_SIZE + 1)
+#define PROFILE_RECHECK (1L << 20)
+
+#if (SLAB_SIZE & (SLAB_SIZE - 1)) != 0 || SLAB_SIZE < LARGE_BLOCK_SIZE
+#error "SLAB_SIZE must be a power of two no smaller than LARGE_BLOCK_SIZE"
+#endif
+
+/*
+ * Descriptor at the start of every slab page, just after the page's block
+ * header.  Slabs of one class that still have free slots are kept on a
+ * doubly-linked list.  A set bit in free_map marks a free slot.
+ */
+typedef struct slab {
+    struct slab *next;
+    struct slab *prev;
+    unsigned short slot_size;
+    unsigned short num_slots;
+    unsigned short num_free;
+    unsigned short map_words;
+    unsigned long long free_map[];
+} slab;
+
+/*
+ * The memory pool is split into NUM_ARENAS equal, independent arenas.  In the
+ * thread-safe build each has its own lock, and threads are spread across them
+ * round-robin; otherwise a single arena spans the whole pool.
+ */
+#ifndef NUM_ARENAS
+#ifdef MYALLOC_THREADS
+#define NUM_ARENAS 4
+#else
+#define NUM_ARENAS 1
+#endif
+#endif
+
+/*
+ * Everything needed to manage one arena's share of the memory pool: the
+ * boundaries of its heap, its free-block index and its slabs.  A block's
+ * arena is implied by its address, since arenas do not overlap.
+ */
+typedef struct arena {
+    /* Always points to the beginning of the arena's part of the pool. */
+    unsigned char *mem;
+    /* Always points to the first block header in the arena. */
+    size_t *start;
+    /* Always points just past the last block of the heap. */
+    size_t *end;
+    /* The heap may grow up to here, the end of the arena's reservation. */
+    size_t *limit;
+    /* Everything before this page boundary is committed memory. */
+    unsigned char *committed;
+    /*
+     * The unit the arena is committed and trimmed in: the system page size,
+     * or HUGE_PAGE_SIZE if the pool is backed by huge pages.
+     */
+    size_t page;
+    /* The NUMA node the arena's memory is placed on, by index in node_ids. */
+    int node;
+    /*
+     * From here on, the heap reads as zeros, save for the header and footer
+     * of the top block and the epilogue: it has never been handed out, or
+     * has been released to the system since.  Every other block lies below.
+     */
+    unsigned char *clean;
+
+    /* Heads of the segregated free lists, one per size class. */
+    size_t *bins[NUM_BINS];
+    /* Bit i is set exactly when bins[i] is non-empty. */
+    unsigned int binmap;
+#if PLACEMENT == NEXT_FIT
+    /* Where the next search of each bin starts, or 0 for its head. */
+    size_t *rover[NUM_BINS];
+#endif
+    /* Root of the tree of free blocks of at least LARGE_BLOCK_SIZE bytes. */
+    size_t *tree_root;
+    /*
+     * The free block that ends the heap, if there is one, which is kept out
+     * of the bins and the tree so that it is only used when nothing else
+     * fits.  How large it is depends on how far the heap could grow, and
+     * placement should not.
+     */
+    size_t *top;
+
+    /*
+     * One byte per SLAB_SIZE page of the heap, non-zero when that page is a
+     * slab.  The map is kept at the very beginning of the arena.
+     */
+    unsigned char *slab_map;
+    /* Number of whole pages in the heap, and so the entries in slab_map. */
+    size_t num_pages;
+    /* Slabs with at least one free slot, one list per size class. */
+    slab *partial_slabs[NUM_SLAB_CLASSES];
+    /* Live ordinary blocks in each slab class, as a measure of demand. */
+    int small_live[NUM_SLAB_CLASSES];
+    /*
+     * Quick lists of freed blocks, indexed by block size in ALIGNMENT units,
+     * linked through the first word of each payload.
+     */
+    size_t *quick[NUM_QUICK_LISTS];
+    int quick_count[NUM_QUICK_LISTS];
+    /* Number of blocks on all of the quick lists together. */
+    int quick_blocks;
+
+    /*
+     * Running totals for myalloc_stats(): the bytes and blocks in the
+     * free-block index, and just past the highest block ever allocated.
+     */
+    size_t free_bytes;
+    size_t free_blocks;
+    size_t *high_water;
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long splits;
+    unsigned long coalesces;
+    /* Bytes the compactor has moved. */
+    size_t compacted;
+    /*
+     * The header of the block where the compactor's next slice starts, or 0
+     * for the start of the heap.  Merging a block into the one before it
+     * moves the cursor back, so that it always stays on a block boundary.
+     */
+    size_t *compact_cursor;
+
+#ifdef MYALLOC_THREADS
+    /* Serializes all access to the arena. */
+    pthread_mutex_t lock;
+    /*
+     * Blocks freed by threads whose home is another arena.  This is a
+     * lock-free stack linked through the first word of each payload: any
+     * thread may push, and whoever holds the lock drains it.
+     */
+    unsigned char *remote_frees;
+#endif
+} arena;
+
+/*
+ * A memory pool: one reservation of address space, split into arenas laid
+ * out back to back.  The default pool behind myalloc() has NUM_ARENAS of
+ * them; a pool from pool_create() has a single arena, and its descriptor
+ * lives in the first pages of its own reservation.
+ */
+struct pool {
+    /* Always points to the beginning of the pool's part of the reservation. */
+    unsigned char *mem;
+    size_t size;
+    /* The arenas the pool is divided into, and the size of each one. */
+    int num_arenas;
+    size_t arena_span;
+    /* The NUMA nodes the arenas are spread over, 1 if they are not. */
+    int num_nodes;
+    arena arenas[NUM_ARENAS];
+};
+
+#ifdef MYALLOC_THREADS
+/*
+ * In the thread-safe build every thread keeps a cache of recently freed
+ * blocks with at most TCACHE_MAX_SIZE usable bytes, in classes spaced
+ * ALIGNMENT bytes apart.  A class holds at most TCACHE_COUNT blocks.  The
+ * shared heap is only locked to refill an empty class with TCACHE_BATCH
+ * blocks at once, or to give back half of a full class.
+ */
+#ifndef TCACHE_MAX_SIZE
+#define TCACHE_MAX_SIZE 512
+#endif
+#ifndef TCACHE_COUNT
+#define TCACHE_COUNT 16
+#endif
+#ifndef TCACHE_BATCH
+#define TCACHE_BATCH 4
+#endif
+
+#define NUM_TCACHE_CLASSES (TCACHE_MAX_SIZE / ALIGNMENT)
+
+/*
+ * A thread's block cache.  Cached blocks are still allocated as far as the
+ * heap is concerned; each class is a singly-linked list threaded through the
+ * first word of the cached payloads.  The cache belongs to one generation of
+ * the pool, and is discarded when init_myalloc() starts a new one.
+ */
+typedef struct tcache {
+    unsigned long generation;
+    unsigned char *head[NUM_TCACHE_CLASSES];
+    int count[NUM_TCACHE_CLASSES];
+} tcache;
+#endif
+
+size_t * get_header(size_t *footer);
+size_t block_size(size_t *header);
+size_t * fit_block(arena *a, size_t size);
+size_t * get_footer(size_t *header);
+size_t * get_next_header(arena *a, size_t *header);
+int arena_grow(arena *a, size_t size);
+size_t * back_coalesce(arena *a, size_t * header);
+void fwd_coalesce(arena *a, size_t * header);
+int bin_index(size_t size);
+void insert_free_block(arena *a, size_t *header);
+void remove_free_block(arena *a, size_t *header);
+void set_block_size(size_t *header, size_t size);
+size_t * tree_insert(size_t *root, size_t *header);
+size_t * tree_remove(size_t *root, size_t *header);
+size_t * tree_best_fit(arena *a, size_t size);
+size_t * tree_first_fit(arena *a, size_t size);
+void free_block(arena *a, size_t *header);
+long trim_block(arena *a, size_t *header, unsigned char *from,
+                unsigned char *to);
+slab * find_slab(arena *a, unsigned char *ptr);
+unsigned char * slab_alloc(arena *a, size_t size);
+void slab_free(arena *a, slab *page, unsigned char *ptr);
+int slab_fit(int slot_size);
+unsigned char * heap_alloc(arena *a, size_t size);
+unsigned char * heap_alloc_aligned(arena *a, size_t size, size_t alignment);
+int heap_alloc_run(arena *a, size_t size, int count, unsigned char **out);
+void heap_free(arena *a, unsigned char *ptr);
+int heap_free_run(arena *a, unsigned char **ptrs, int first, int n);
+int heap_resize(arena *a, unsigned char *ptr, size_t size);
+size_t usable_size(unsigned char *ptr);
+int is_mapped(unsigned char *ptr);
+unsigned char * mapped_alloc(size_t size, size_t alignment);
+void mapped_free(unsigned char *ptr);
+unsigned char * mapped_realloc(unsigned char *ptr, size_t size);
+void forget_samples();
+void forget_handles();
+void init_arena(arena *a, unsigned char *base, size_t size, size_t page);
+arena * arena_of(pool_t *pool, unsigned char *ptr);
+
+/*!
+ * These variables are used to specify the size and address of the memory pool
+ * that the simple allocator works against.  The memory pool is allocated within
+ * init_myalloc(), and then myalloc() and free() work against this pool of
+ * memory, the default pool.
+ */
+
+size_t MEMORY_SIZE;
+static pool_t default_pool;
+
+/* The page size of the system. */
+static long page_size;
+/*
+ * The NUMA nodes of the system, up to MYALLOC_MAX_NODES of them, and the
+ * system's number for each.  Arenas refer to their node by its index here.
+ */
+static int num_nodes;
+static int node_ids[MYALLOC_MAX_NODES];
+/* How the next init_myalloc() should back the pool with huge pages. */
+static int huge_pages = MYALLOC_HUGE_NONE;
+/*
+ * Number of slots a slab page of each class holds, or 0 for classes that a
+ * page of ordinary blocks would pack at least as densely.
+ */
+static int slab_capacity[NUM_SLAB_CLASSES];
+/*
+ * Totals for the chunks mapped on their own, which no arena sees.  They are
+ * updated atomically, since mapping takes no lock.
+ */
+static size_t mapped_bytes;
+static unsigned long mapped_allocs;
+static unsigned long mapped_frees;
+/* The most bytes mapped at once since init_myalloc(). */
+static size_t mapped_peak;
+/* Requests of at least this many bytes are mapped on their own, unless 0. */
+static size_t mmap_threshold = MMAP_THRESHOLD;
+
+/*
+ * The heap profiler's tables: one entry per distinct stack, with the number
+ * and bytes of its live and of all of its samples, and one per live sample.
+ * Both are chained in hash tables, by stack and by address, through 1-based
+ * indices, so that zeroed memory is an empty profile.
+ */
+typedef struct profile_stack {
+    unsigned long hash;
+    int depth;
+    int next;
+    void *frames[PROFILE_DEPTH];
+    size_t live_count;
+    size_t live_bytes;
+    size_t total_count;
+    size_t total_bytes;
+} profile_stack;
+
+typedef struct profile_sample {
+    unsigned char *ptr;
+    size_t size;
+    /* When the sample was taken, in milliseconds. */
+    long time;
+    int stack;
+    int next;
+} profile_sample;
+
+typedef struct profile_table {
+    int stack_heads[PROFILE_MAX_STACKS];
+    int num_stacks;
+    profile_stack stacks[PROFILE_MAX_STACKS];
+    int sample_heads[PROFILE_MAX_SAMPLES];
+    /* Samples past this mark have never been used; freed ones are chained. */
+    int num_samples;
+    int free_samples;
+    profile_sample samples[PROFILE_MAX_SAMPLES];
+    unsigned long dropped;
+    size_t period;
+} profile_table;
+
+/*
+ * The profile, mapped on its own when the profiler is first started, and the
+ * sampling period, which is 0 while it is stopped.  profile_used stays set
+ * once it has been started, so that frees only look for the SAMPLED flag if
+ * there can be any.
+ */
+static profile_table *profile;
+static size_t profile_period;
+static int profile_used;
+#ifdef MYALLOC_THREADS
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Bytes the calling thread may allocate before its next sample. */
+static __thread long sample_countdown;
+static __thread unsigned long sample_random;
+#else
+static long sample_countdown;
+static unsigned long sample_random;
+#endif
+
+/*
+ * The payload of the last block the calling thread carved out of a heap,
+ * where the clean part of the heap began in it, and the trimmed pages of the
+ * free block it came from, if any, for mycalloc().
+ */
+typedef struct carve_record {
+    unsigned char *payload;
+    unsigned char *clean;
+    unsigned char *zero_from;
+    unsigned char *zero_to;
+} carve_record;
+#ifdef MYALLOC_THREADS
+static __thread carve_record last_carve;
+#else
+static carve_record last_carve;
+#endif
+
+/*
+ * A handle names a chunk of the default pool that the compactor may move
+ * while nobody has it pinned.  Handles are kept outside the pool, in tables
+ * of HANDLE_CHUNK_SIZE bytes mapped on their own, so that they never stand in
+ * the compactor's way; free handles are chained through their payload field.
+ */
+struct myalloc_handle {
+    /* The payload of the handle's block, which starts with HANDLE_PREFIX. */
+    unsigned char *payload;
+    /* How many times the chunk is pinned, or -1 while it is being moved. */
+    int pins;
+};
+
+#define HANDLE_CHUNK_SIZE (64 * 1024)
+
+typedef struct handle_chunk {
+    struct handle_chunk *next;
+    struct myalloc_handle handles[];
+} handle_chunk;
+
+#define HANDLES_PER_CHUNK ((HANDLE_CHUNK_SIZE - sizeof(handle_chunk)) \
+                           / sizeof(struct myalloc_handle))
+
+/*
+ * Every table of handles mapped since init_myalloc(), and the free handles in
+ * them.  In the thread-safe build, handle_lock guards both.
+ */
+static handle_chunk *handle_chunks;
+static myalloc_handle_t free_handles;
+#ifdef MYALLOC_THREADS
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+/* The arena of the default pool the compactor's next slice starts in. */
+static int compact_arena;
+
+/* Consulted whenever a request cannot be served, if it is set. */
+static myalloc_oom_handler_t oom_handler;
+/*
+ * Where diagnostics go, or 0 for standard error, and how often; the time of
+ * the last one passed on, in milliseconds, and how many were held back since.
+ */
+static myalloc_diagnostic_hook_t diagnostic_hook;
+static long diagnostic_interval = DIAGNOSTIC_INTERVAL;
+static long last_diagnostic = -1;
+static unsigned long held_diagnostics;
+
+#ifdef MYALLOC_THREADS
+/* Counts calls to init_myalloc(), so that stale thread caches are noticed. */
+static unsigned long pool_generation;
+/* Flushes a thread's cache when the thread exits. */
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+/* The calling thread's block cache. */
+static __thread tcache thread_cache;
+/* The arena the calling thread allocates from, and the next one to hand out. */
+static __thread arena *thread_arena;
+static unsigned int next_arena;
+#endif
+
+/*
+ * Fills in node_ids with the NUMA nodes that are online, at most
+ * MYALLOC_MAX_NODES of them, and returns how many there are, or 1 if the
+ * system has no NUMA.  The list of nodes is read without stdio, which could
+ * allocate.  It reads like "0-1,3", and nodes need not be numbered without
+ * gaps; those that mbind() could not name in one word of mask are left out.
+ */
+static int find_nodes() {
+    char online[256];
+    ssize_t length;
+    int count = 0;
+    int first = -1;
+    int number = -1;
+    int fd = open("/sys/devices/system/node/online", O_RDONLY);
+    if (fd >= 0) {
+        length = read(fd, online, sizeof(online));
+        close(fd);
+        for (ssize_t i = 0; i <= length; i++) {
+            char c = i < length ? online[i] : '\n';
+            if (c >= '0' && c <= '9') {
+                number = (number < 0 ? 0 : number * 10) + c - '0';
+                continue;
+            }
+            if (c == '-') {
+                first = number;
+            }
+            else if (number >= 0) {
+                /* A single node is a range of one. */
+                for (int node = first >= 0 ? first : number;
+                     node <= number && count < MYALLOC_MAX_NODES; node++) {
+                    if (node < (int) (sizeof(unsigned long) * CHAR_BIT)) {
+                        node_ids[count++] = node;
+                    }
+                }
+                first = -1;
+            }
+            number = -1;
+        }
+    }
+    if (count == 0) {
+        node_ids[0] = 0;
+        count = 1;
+    }
+    return count;
+}
+/*
+ * Works out what every pool shares: the page size of the system, the NUMA
+ * nodes, and how many slots a slab page of each class holds.
+ */
+static void init_constants() {
+    page_size = sysconf(_SC_PAGESIZE);
+    num_nodes = find_nodes();
+    for (int i = 0; i < NUM_SLAB_CLASSES; i++) {
+        slab_capacity[i] = slab_fit((i + 1) * ALIGNMENT);
+    }
+}
+/*
+ * Places the whole pages of the reservation at base on a NUMA node, before
+ * any of them are touched.  Pages an arena shares with its neighbours are
+ * left alone.  If the system will not, the pages simply go wherever they are
+ * first touched.
+ */
+static void bind_arena(unsigned char *base, size_t size, int node) {
+    unsigned long mask = 1UL << node;
+    uintptr_t from = ((uintptr_t) base + page_size - 1) & ~(page_size - 1);
+    uintptr_t to = ((uintptr_t) base + size) & ~(page_size - 1);
+    if (to > from) {
+        syscall(SYS_mbind, from, to - from, NUMA_POLICY, &mask,
+                sizeof(mask) * CHAR_BIT, 0);
+    }
+}
+/*
+ * Sets up a pool managing the "size" bytes of reservation at mem, split into
+ * num_arenas arenas, which are committed in units of "page" bytes and spread
+ * over "nodes" NUMA nodes.  Arenas start on a huge page boundary when they
+ * are backed by huge pages.
+ */
+static void init_pool(pool_t *pool, unsigned char *mem, size_t size,
+                      int num_arenas, size_t page, int nodes) {
+    size_t align = page > (size_t) page_size ? page : ALIGNMENT;
+    size_t span = (size / num_arenas) & ~(align - 1);
+
+    pool->mem = mem;
+    pool->size = size;
+    pool->num_arenas = num_arenas;
+    pool->arena_span = span;
+    pool->num_nodes = nodes;
+    /* Carve the pool into arenas; the last one also takes any remainder. */
+    for (int i = 0; i < num_arenas; i++) {
+        size_t arena_size = i < num_arenas - 1 ? span
+                            : size - (num_arenas - 1) * span;
+        if (nodes > 1) {
+            bind_arena(mem + i * span, arena_size, node_ids[i % nodes]);
+        }
+        init_arena(&pool->arenas[i], mem + i * span, arena_size, page);
+        pool->arenas[i].node = i % nodes;
+    }
+}
+#ifdef MYALLOC_THREADS
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+/*
+ * Every lock of the default pool is held across a fork(), so that the child
+ * gets the pool in a consistent state, and the child makes its locks anew,
+ * since it has only the one thread.  Blocks in the caches of the threads the
+ * child does not have are simply lost to it.
+ */
+static void fork_prepare() {
+    pthread_mutex_lock(&profile_lock);
+    pthread_mutex_lock(&handle_lock);
+    for (int i = 0; i < default_pool.num_arenas; i++) {
+        pthread_mutex_lock(&default_pool.arenas[i].lock);
+    }
+}
+static void fork_parent() {
+    for (int i = default_pool.num_arenas - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&default_pool.arenas[i].lock);
+    }
+    pthread_mutex_unlock(&handle_lock);
+    pthread_mutex_unlock(&profile_lock);
+}
+static void fork_child() {
+    for (int i = 0; i < default_pool.num_arenas; i++) {
+        pthread_mutex_init(&default_pool.arenas[i].lock, 0);
+    }
+    pthread_mutex_init(&handle_lock, 0);
+    pthread_mutex_init(&profile_lock, 0);
+}
+static void register_fork_handlers() {
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+#endif
+/*
+ * Returns 1 if the system may back memory with transparent huge pages when
+ * asked to.  The setting is read without stdio, which could allocate.
+ */
+static int transparent_huge_pages() {
+    char setting[64];
+    ssize_t length;
+    int fd = open("/sys/kernel/mm/transparent_hugepage/enabled", O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    length = read(fd, setting, sizeof(setting) - 1);
+    close(fd);
+    if (length <= 0) {
+        return 0;
+    }
+    setting[length] = 0;
+    return strstr(setting, "[never]") == 0;
+}
+/*
+ * Reserves *size bytes of address space for the default pool, backed by huge
+ * pages if myalloc_set_huge_pages() asked for them and the system has them,
+ * and otherwise by ordinary pages.  With huge pages, *size is rounded up to
+ * a whole number of them.  Sets *page to the unit the pool is to be committed
+ * in, and returns the reservation, or MAP_FAILED.
+ */
+static unsigned char * reserve_pool(size_t *size, size_t *page) {
+    size_t huge = HUGE_PAGE_SIZE;
+    size_t length = (*size + huge - 1) & ~(huge - 1);
+    unsigned char *mem;
+
+    *page = page_size;
+    if (huge_pages == MYALLOC_HUGE_NONE || length < *size
+        || length + huge < length) {
+        return mmap(0, *size, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    /*
+     * Without MAP_NORESERVE, the system sets aside huge pages for the whole
+     * pool now, or refuses, rather than failing a fault later on.
+     */
+    if (huge_pages == MYALLOC_HUGE_TLB) {
+        mem = mmap(0, length, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            *size = length;
+            *page = huge;
+            return mem;
+        }
+    }
+    /*
+     * For transparent huge pages, reserve a huge page too many, and keep just
+     * the range of it that is aligned to huge pages.
+     */
+    mem = MAP_FAILED;
+    if (transparent_huge_pages()) {
+        mem = mmap(0, length + huge, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (mem != MAP_FAILED) {
+        unsigned char *aligned = (unsigned char *)
+            (((uintptr_t) mem + huge - 1) & ~(uintptr_t) (huge - 1));
+        if (aligned > mem) {
+            munmap(mem, aligned - mem);
+        }
+        munmap(aligned + length, mem + huge - aligned);
+        if (madvise(aligned, length, MADV_HUGEPAGE) == 0) {
+            *size = length;
+            *page = huge;
+            return aligned;
+        }
+        munmap(aligned, length);
+    }
+    return mmap(0, *size, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+}
+/*!
+ * This function initializes both the allocator state, and the memory pool.  It
+ * must be called before myalloc() or myfree() will work at all.
+ *
+ * The memory pool is MEMORY_SIZE bytes of address space reserved with mmap(),
+ * but none of it is backed by memory yet.  Pages are committed as the heap
+ * grows, so the resident size of the pool follows what is actually in use,
+ * and MEMORY_SIZE only bounds how far the heap may grow.  Huge pages, if
+ * myalloc_set_huge_pages() asks for them, are committed one at a time.  The
+ * thread-safe build also makes sure the pool survives a fork() from any
+ * thread.
+ */
+
+void init_myalloc() {
+    unsigned char *mem;
+    size_t size = MEMORY_SIZE;
+    size_t page;
+#ifdef MYALLOC_THREADS
+    /* Blocks cached by any thread belong to the previous pool. */
+    pool_generation++;
+#endif
+    forget_samples();
+    forget_handles();
+    __atomic_store_n(&mapped_peak,
+                     __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    init_constants();
+    /*
+     * Reserve the entire memory pool, from which our simple allocator will
+     * serve allocation requests.  Nothing can be accessed until committed.
+     */
+    mem = reserve_pool(&size, &page);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr,
+                "init_myalloc: could not reserve %zu bytes from the system\n",
+                MEMORY_SIZE);
+        abort();
+    }
+    init_pool(&default_pool, mem, size, NUM_ARENAS, page, num_nodes);
+#ifdef MYALLOC_THREADS
+    /* Last, since registering may allocate, from the pool if it is malloc(). */
+    pthread_once(&fork_once, register_fork_handlers);
+#endif
+}
+/* Rounds an address up to the next page boundary of an arena. */
+static unsigned char * page_round(arena *a, unsigned char *ptr) {
+    return (unsigned char *) (((uintptr_t) ptr + a->page - 1)
+                              & ~(uintptr_t) (a->page - 1));
+}
+/* Rounds an address down to a page boundary of an arena. */
+static unsigned char * page_trunc(arena *a, unsigned char *ptr) {
+    return (unsigned char *) ((uintptr_t) ptr & ~(uintptr_t) (a->page - 1));
+}
+/*
+ * Makes the memory from the arena's commit frontier up to the page boundary
+ * at or after "to" usable.  Returns 0 if the system refuses.  Pages at the
+ * edges of an arena may be shared with its neighbour, which is harmless.
+ */
+static int arena_commit(arena *a, unsigned char *to) {
+    unsigned char *from = a->committed;
+    to = page_round(a, to);
+    if (to <= from) {
+        return 1;
+    }
+    if (mprotect(from, to - from, PROT_READ | PROT_WRITE) != 0) {
+        return 0;
+    }
+    a->committed = to;
+    return 1;
+}
+/* Empties the free-block index, the slab lists and quick lists of an arena. */
+static void clear_arena(arena *a) {
+    for (int i = 0; i < NUM_BINS; i++) {
+        a->bins[i] = 0;
+#if PLACEMENT == NEXT_FIT
+        a->rover[i] = 0;
+#endif
+    }
+    a->binmap = 0;
+    a->tree_root = 0;
+    a->top = 0;
+    for (int i = 0; i < NUM_SLAB_CLASSES; i++) {
+        a->partial_slabs[i] = 0;
+        a->small_live[i] = 0;
+    }
+    for (int i = 0; i < NUM_QUICK_LISTS; i++) {
+        a->quick[i] = 0;
+        a->quick_count[i] = 0;
+    }
+    a->quick_blocks = 0;
+    a->free_bytes = 0;
+    a->free_blocks = 0;
+    a->allocs = 0;
+    a->frees = 0;
+    a->splits = 0;
+    a->coalesces = 0;
+    a->compacted = 0;
+    a->compact_cursor = 0;
+#ifdef MYALLOC_THREADS
+    a->remote_frees = 0;
+#endif
+}
+/*
+ * Sets up an arena managing the "size" bytes of the reservation at base,
+ * committed in units of "page" bytes.  Only the slab map is committed; the
+ * heap starts out empty, and grows on demand up to the end of the arena.
+ */
+void init_arena(arena *a, unsigned char *base, size_t size, size_t page) {
+    size_t heap_size;
+    size_t map_size;
+
+    clear_arena(a);
+#ifdef MYALLOC_THREADS
+    pthread_mutex_init(&a->lock, 0);
+#endif
+
+    /* Reserve the slab map ahead of the first block. */
+    a->mem = base;
+    map_size = (size / SLAB_SIZE + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    a->slab_map = base;
+    a->start = (size_t *) (base + map_size + HEAP_PAD);
+    /*
+     * Only whole, aligned blocks fit in the arena, followed by the epilogue;
+     * any tail slack is unused.
+     */
+    heap_size = 0;
+    if (size >= map_size + HEAP_PAD + sizeof(size_t) + MIN_BLOCK_SIZE) {
+        heap_size = (size - map_size - HEAP_PAD - sizeof(size_t))
+                    & ~(ALIGNMENT - 1);
+    }
+    /* A fresh mapping reads as zeros, so every page starts out as no slab. */
+    a->num_pages = heap_size / SLAB_SIZE;
+    a->page = page;
+    a->committed = page_trunc(a, base);
+    if (heap_size == 0 || !arena_commit(a, (unsigned char *) (a->start + 1))) {
+        heap_size = 0;
+    }
+    else {
+        *a->start = BLOCK_ALLOCATED;
+    }
+    /* Set pointers to end for use in comparison later. */
+    a->end = a->start;
+    a->high_water = a->start;
+    a->clean = (unsigned char *) a->start;
+    a->limit = (size_t *) ((unsigned char *) a->start + heap_size);
+}
+/*
+ * Returns the header of the top block of an arena's heap, the one that ends
+ * at a->end, if that block is free.  Otherwise returns a->end itself, which
+ * is where a new top block would go.
+ */
+static size_t * top_block(arena *a) {
+    if (*a->end & PREV_FREE) {
+        return get_header(a->end - 1);
+    }
+    return a->end;
+}
+/*
+ * Makes the heap of an arena use everything that was committed, up to the end
+ * of the arena and leaving room for the epilogue, with a free top block that
+ * starts at "top".  That block must not be on a free list.
+ */
+static void arena_fill(arena *a, size_t *top) {
+    unsigned char *end = (unsigned char *) a->start
+        + ((a->committed - sizeof(size_t) - (unsigned char *) a->start)
+           & ~(ALIGNMENT - 1));
+    if (end > (unsigned char *) a->limit) {
+        end = (unsigned char *) a->limit;
+    }
+    set_block_size(top, end - (unsigned char *) top);
+    a->end = (size_t *) end;
+    *a->end = BLOCK_ALLOCATED | PREV_FREE;
+    insert_free_block(a, top);
+}
+/*
+ * Grows the heap of an arena so that its top block is free and at least
+ * "size" bytes long, committing more of the reservation as needed.  Returns 0
+ * if the arena's reservation does not have enough room left.
+ */
+int arena_grow(arena *a, size_t size) {
+    size_t *top;
+    unsigned char *end;
+
+    /* An arena too small for any block has no epilogue, and never grows. */
+    if (a->limit == a->start) {
+        return 0;
+    }
+    /* The top block can be extended if it is free. */
+    top = top_block(a);
+    end = (unsigned char *) top + size;
+    if (size < MIN_BLOCK_SIZE || end > (unsigned char *) a->limit) {
+        return 0;
+    }
+    /* Commit in large steps, to keep the number of system calls down. */
+    if (end < a->committed + COMMIT_SIZE) {
+        end = a->committed + COMMIT_SIZE;
+    }
+    if (end > (unsigned char *) a->limit) {
+        end = (unsigned char *) a->limit;
+    }
+    if (!arena_commit(a, end + sizeof(size_t))) {
+        return 0;
+    }
+    if (top != a->end) {
+        remove_free_block(a, top);
+    }
+    /* The old footer and epilogue end up inside the top block. */
+    if ((unsigned char *) (a->end - 1) >= a->clean) {
+        a->end[-1] = 0;
+    }
+    if ((unsigned char *) a->end >= a->clean) {
+        *a->end = 0;
+    }
+    arena_fill(a, top);
+    return 1;
+}
+/*
+ * Forgets every block in an arena at once.  The slab map is cleared only as
+ * far as the heap reached, and whatever memory is already committed becomes
+ * a single free block again, just as a fresh heap would grow to, though only
+ * what lies beyond it is still clean.
+ */
+static void reset_arena(arena *a) {
+    if (a->limit == a->start) {
+        return;
+    }
+    clear_arena(a);
+    memset(a->slab_map, 0,
+           ((unsigned char *) a->end - (unsigned char *) a->start)
+           / SLAB_SIZE + 1);
+    a->end = a->start;
+    a->high_water = a->start;
+    a->clean = a->committed;
+    *a->end = BLOCK_ALLOCATED;
+    if (a->committed - (unsigned char *) a->start
+        >= (long) (MIN_BLOCK_SIZE + sizeof(size_t))) {
+        arena_fill(a, a->start);
+    }
+}
+/*
+ * Returns the arena whose part of a pool contains ptr.  Arenas are laid out
+ * back to back, so this is a division.
+ */
+arena * arena_of(pool_t *pool, unsigned char *ptr) {
+    long index = pool->arena_span == 0 ? 0
+                 : (ptr - pool->mem) / pool->arena_span;
+    if (index >= pool->num_arenas) {
+        index = pool->num_arenas - 1;
+    }
+    return &pool->arenas[index];
+}
+/* Acquires exclusive access to an arena in the thread-safe build. */
+static void lock_arena(arena *a) {
+#ifdef MYALLOC_THREADS
+    pthread_mutex_lock(&a->lock);
+#endif
+}
+static void unlock_arena(arena *a) {
+#ifdef MYALLOC_THREADS
+    pthread_mutex_unlock(&a->lock);
+#endif
+}
+#ifdef MYALLOC_THREADS
+/*
+ * Pushes a block onto its arena's remote-free stack without taking the arena
+ * lock.  Unless another thread pushes at the same moment, this is one CAS.
+ */
+static void remote_free(arena *a, unsigned char *ptr) {
+    unsigned char *head = __atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED);
+    do {
+        *(unsigned char **) ptr = head;
+    } while (!__atomic_compare_exchange_n(&a->remote_frees, &head, ptr, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+#endif
+/*
+ * Frees, and coalesces, every block that other threads have pushed onto the
+ * arena's remote-free stack.  The arena must be locked.  The whole stack is
+ * detached with one exchange, so concurrent pushes are never lost.
+ */
+static void drain_remote_frees(arena *a) {
+#ifdef MYALLOC_THREADS
+    unsigned char *block;
+    if (__atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    block = __atomic_exchange_n(&a->remote_frees, 0, __ATOMIC_ACQUIRE);
+    while (block != 0) {
+        unsigned char *next = *(unsigned char **) block;
+        heap_free(a, block);
+        block = next;
+    }
+#endif
+}
+#ifdef MYALLOC_THREADS
+/*
+ * Returns the index in node_ids of the NUMA node the calling thread is
+ * running on, or -1 if the pool does not spread its arenas over nodes, or
+ * the node is not one of them.
+ */
+static int current_node(pool_t *pool) {
+    unsigned int cpu;
+    unsigned int node;
+    if (pool->num_nodes <= 1 || getcpu(&cpu, &node) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < pool->num_nodes; i++) {
+        if (node_ids[i] == (int) node) {
+            return i;
+        }
+    }
+    return -1;
+}
+/*
+ * Picks a new arena for the calling thread, round-robin among the arenas on
+ * the node it is running on, if there are any, or else among all of them.
+ */
+static arena * pick_arena(pool_t *pool) {
+    unsigned int next = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+    int node = current_node(pool);
+    if (node >= 0 && node < pool->num_nodes && node < pool->num_arenas) {
+        /* Arena i is on node i % num_nodes. */
+        int local = (pool->num_arenas - node + pool->num_nodes - 1)
+                    / pool->num_nodes;
+        return &pool->arenas[node + (next % local) * pool->num_nodes];
+    }
+    return &pool->arenas[next % pool->num_arenas];
+}
+#endif
+/*
+ * Returns the arena of a pool the calling thread should allocate from.  In
+ * the default pool, threads are assigned to arenas the first time they
+ * allocate, preferring the arenas on their NUMA node; other pools have just
+ * the one arena.
+ */
+static arena * home_arena(pool_t *pool) {
+#ifdef MYALLOC_THREADS
+    if (pool == &default_pool) {
+        if (thread_arena == 0) {
+            thread_arena = pick_arena(pool);
+        }
+        return thread_arena;
+    }
+#endif
+    return &pool->arenas[0];
+}
+/*
+ * Returns the calling thread's arena like home_arena(), but first moves the
+ * thread to an arena on its node if it has been moved to another NUMA node.
+ * This is only checked on the way to taking an arena's lock, which costs far
+ * more.
+ */
+static arena * local_arena(pool_t *pool) {
+#ifdef MYALLOC_THREADS
+    if (pool == &default_pool && thread_arena != 0 && pool->num_nodes > 1
+        && current_node(pool) != thread_arena->node) {
+        thread_arena = pick_arena(pool);
+    }
+#endif
+    return home_arena(pool);
+}
+/*
+ * Allocates from the calling thread's arena of a pool, falling back on the
+ * others in turn when it cannot serve the request, those on the same NUMA
+ * node first.  Alignments beyond ALIGNMENT need the aligned allocation path.
+ */
+static unsigned char * arena_alloc(pool_t *pool, size_t size,
+                                   size_t alignment) {
+    arena *home = local_arena(pool);
+    unsigned char *result = 0;
+
+    for (int i = 0; i < 2 * pool->num_arenas && result == 0; i++) {
+        int index = (home - pool->arenas + i) % pool->num_arenas;
+        arena *a = &pool->arenas[index];
+        /* The first round only visits the arenas on the home node. */
+        if ((a->node == home->node) != (i < pool->num_arenas)) {
+            continue;
+        }
+        lock_arena(a);
+        drain_remote_frees(a);
+        if (alignment > ALIGNMENT) {
+            result = heap_alloc_aligned(a, size, alignment);
+        }
+        else {
+            result = heap_alloc(a, size);
+        }
+        unlock_arena(a);
+    }
+    return result;
+}
+/*
+ * Takes a pointer to a footer of a block memory and returns a pointer
+ * to the block's header.
+ */
+size_t * get_header(size_t *footer) {
+    size_t size;
+    size = *footer;
+    footer = (size_t *) ((unsigned char *) footer - size + sizeof(size_t));
+    return footer;
+}
+/*
+ * Writes "size" into both the header and the footer of the free block starting
+ * at header.
+ */
+void set_block_size(size_t *header, size_t size) {
+    *header = size;
+    *get_footer(header) = size;
+}
+/* Returns the size of a block, free or allocated, without its flags. */
+size_t block_size(size_t *header) {
+    return *header & ~(size_t) (ALIGNMENT - 1);
+}
+/*
+ * Updates the PREV_FREE bit of the header that follows a block; this may be
+ * the epilogue.  Only allocated blocks and the epilogue ever have it set.
+ */
+static void set_prev_free(size_t *next, int prev_free) {
+    if (prev_free) {
+        *next |= PREV_FREE;
+    }
+    else {
+        *next &= ~PREV_FREE;
+    }
+}
+/*
+ * Returns the free-list bin responsible for blocks of the given size.
+ */
+int bin_index(size_t size) {
+    int index = (63 - __builtin_clzl(size)) - 4;
+    if (index < 0) {
+        return 0;
+    }
+    if (index >= NUM_BINS) {
+        return NUM_BINS - 1;
+    }
+    return index;
+}
+/* Returns the tree node stored in the payload of a large free block. */
+static tree_node * get_node(size_t *header) {
+    return (tree_node *) (header + 1);
+}
+/* Returns the height of a subtree, where an empty subtree has height 0. */
+static int tree_height(size_t *header) {
+    return header == 0 ? 0 : get_node(header)->height;
+}
+/* Ordering of tree nodes: by block size, and then by address. */
+static int tree_less(size_t *a, size_t *b) {
+    return *a < *b || (*a == *b && a < b);
+}
+static size_t * tree_rotate_right(size_t *header) {
+    size_t *left = get_node(header)->left;
+    get_node(header)->left = get_node(left)->right;
+    get_node(left)->right = header;
+    return left;
+}
+static size_t * tree_rotate_left(size_t *header) {
+    size_t *right = get_node(header)->right;
+    get_node(header)->right = get_node(right)->left;
+    get_node(right)->left = header;
+    return right;
+}
+static void tree_update_height(size_t *header) {
+    int left = tree_height(get_node(header)->left);
+    int right = tree_height(get_node(header)->right);
+    get_node(header)->height = 1 + (left > right ? left : right);
+}
+/*
+ * Restores the AVL balance condition at a node whose subtrees are balanced
+ * and differ in height by at most two.  Returns the new subtree root.
+ */
+static size_t * tree_rebalance(size_t *header) {
+    tree_node *node = get_node(header);
+    int balance = tree_height(node->left) - tree_height(node->right);
+
+    if (balance > 1) {
+        tree_node *left = get_node(node->left);
+        if (tree_height(left->left) < tree_height(left->right)) {
+            node->left = tree_rotate_left(node->left);
+            tree_update_height(get_node(node->left)->left);
+        }
+        header = tree_rotate_right(header);
+        tree_update_height(get_node(header)->right);
+    }
+    else if (balance < -1) {
+        tree_node *right = get_node(node->right);
+        if (tree_height(right->right) < tree_height(right->left)) {
+            node->right = tree_rotate_right(node->right);
+            tree_update_height(get_node(node->right)->right);
+        }
+        header = tree_rotate_left(header);
+        tree_update_height(get_node(header)->left);
+    }
+    tree_update_height(header);
+    return header;
+}
+/*
+ * Inserts a free block into the subtree rooted at root, and returns the new
+ * root of that subtree.  This takes O(log n) time.
+ */
+size_t * tree_insert(size_t *root, size_t *header) {
+    if (root == 0) {
+        tree_node *node = get_node(header);
+        node->left = 0;
+        node->right = 0;
+        node->height = 1;
+        node->zero_from = 0;
+        node->zero_to = 0;
+        return header;
+    }
+    if (tree_less(header, root)) {
+        get_node(root)->left = tree_insert(get_node(root)->left, header);
+    }
+    else {
+        get_node(root)->right = tree_insert(get_node(root)->right, header);
+    }
+    return tree_rebalance(root);
+}
+/*
+ * Detaches the smallest block from a non-empty subtree, storing it in *min.
+ * Returns the new root of the subtree.
+ */
+static size_t * tree_remove_min(size_t *root, size_t **min) {
+    if (get_node(root)->left == 0) {
+        *min = root;
+        return get_node(root)->right;
+    }
+    get_node(root)->left = tree_remove_min(get_node(root)->left, min);
+    return tree_rebalance(root);
+}
+/*
+ * Removes a block from the subtree rooted at root, which must contain it, and
+ * returns the new root of that subtree.  Since the nodes are the free blocks
+ * themselves, a node with two children is replaced by relinking its in-order
+ * successor into its place.  This takes O(log n) time.
+ */
+size_t * tree_remove(size_t *root, size_t *header) {
+    tree_node *node = get_node(root);
+    if (root == header) {
+        size_t *successor;
+        if (node->left == 0) {
+            return node->right;
+        }
+        if (node->right == 0) {
+            return node->left;
+        }
+        node->right = tree_remove_min(node->right, &successor);
+        get_node(successor)->left = node->left;
+        get_node(successor)->right = node->right;
+        return tree_rebalance(successor);
+    }
+    if (tree_less(header, root)) {
+        node->left = tree_remove(node->left, header);
+    }
+    else {
+        node->right = tree_remove(node->right, header);
+    }
+    return tree_rebalance(root);
+}
+/*
+ * Returns the smallest large free block of at least "size" bytes, preferring
+ * the lowest address among equally sized blocks, or 0 if there is none.
+ */
+size_t * tree_best_fit(arena *a, size_t size) {
+    size_t *result = 0;
+    size_t *header = a->tree_root;
+    while (header != 0) {
+        if (*header >= size) {
+            result = header;
+            header = get_node(header)->left;
+        }
+        else {
+            header = get_node(header)->right;
+        }
+    }
+    return result;
+}
+/*
+ * Returns the first large free block of at least "size" bytes met on the way
+ * down from the root of the tree, or 0 if there is none.
+ */
+size_t * tree_first_fit(arena *a, size_t size) {
+    size_t *header = a->tree_root;
+    while (header != 0 && *header < size) {
+        header = get_node(header)->right;
+    }
+    return header;
+}
+/*
+ * Pushes a free block onto the front of the free list for its size class, or
+ * into the large-block tree, unless it is the top block.  Small blocks are
+ * handled in constant time.
+ */
+void insert_free_block(arena *a, size_t *header) {
+    int index;
+    free_links *links;
+
+    a->free_bytes += *header;
+    a->free_blocks++;
+    if ((unsigned char *) header + *header == (unsigned char *) a->end) {
+        a->top = header;
+        return;
+    }
+    if (*header >= LARGE_BLOCK_SIZE) {
+        a->tree_root = tree_insert(a->tree_root, header);
+        return;
+    }
+    index = bin_index(*header);
+    links = (free_links *) (header + 1);
+    links->prev = 0;
+    links->next = a->bins[index];
+    if (a->bins[index] != 0) {
+        ((free_links *) (a->bins[index] + 1))->prev = header;
+    }
+    a->bins[index] = header;
+    a->binmap |= 1u << index;
+}
+/*
+ * Unlinks a free block from the free list for its size class, or from the
+ * large-block tree, or takes away the top block.  Small blocks are handled in
+ * constant time, since the lists are doubly-linked.
+ */
+void remove_free_block(arena *a, size_t *header) {
+    int index;
+    free_links *links;
+
+    a->free_bytes -= *header;
+    a->free_blocks--;
+    if (header == a->top) {
+        a->top = 0;
+        return;
+    }
+    if (*header >= LARGE_BLOCK_SIZE) {
+        a->tree_root = tree_remove(a->tree_root, header);
+        return;
+    }
+    index = bin_index(*header);
+    links = (free_links *) (header + 1);
+#if PLACEMENT == NEXT_FIT
+    if (a->rover[index] == header) {
+        a->rover[index] = links->next;
+    }
+#endif
+    if (links->prev != 0) {
+        ((free_links *) (links->prev + 1))->next = links->next;
+    }
+    else {
+        a->bins[index] = links->next;
+        if (a->bins[index] == 0) {
+            a->binmap &= ~(1u << index);
+        }
+    }
+    if (links->next != 0) {
+        ((free_links *) (links->next + 1))->prev = links->prev;
+    }
+}
+#if PLACEMENT == FIRST_FIT || PLACEMENT == NEXT_FIT
+/*
+ * Returns the first block of at least "size" bytes in bin "index", or 0 if
+ * there is none.  Under next fit, the search starts at the bin's roving
+ * pointer and wraps around, and the pointer is left at the block found.
+ */
+static size_t * bin_first_fit(arena *a, int index, size_t size) {
+#if PLACEMENT == NEXT_FIT
+    size_t *start = a->rover[index] != 0 ? a->rover[index] : a->bins[index];
+    size_t *header = start;
+    while (header != 0) {
+        if (*header >= size) {
+            a->rover[index] = header;
+            return header;
+        }
+        header = ((free_links *) (header + 1))->next;
+        if (header == 0) {
+            header = a->bins[index];
+        }
+        if (header == start) {
+            break;
+        }
+    }
+    return 0;
+#else
+    size_t *header;
+    for (header = a->bins[index]; header != 0;
+         header = ((free_links *) (header + 1))->next) {
+        if (*header >= size) {
+            return header;
+        }
+    }
+    return 0;
+#endif
+}
+#define tree_fit tree_first_fit
+#else
+/*
+ * Returns 1 if free block x fits more tightly than free block y, or as
+ * tightly but, under address-ordered fit, at a lower address.
+ */
+static int better_fit(size_t *x, size_t *y) {
+#if PLACEMENT == ADDRESS_FIT
+    return *x < *y || (*x == *y && x < y);
+#else
+    return *x < *y;
+#endif
+}
+#define tree_fit tree_best_fit
+#endif
+/*
+ * Returns a pointer to the header of the free block in the bins or the tree of
+ * at least "size" bytes that the placement policy picks, or 0 if there is
+ * none.  Only free blocks are examined: the search starts in the bin for
+ * "size", and if nothing there is large enough, a block of the next non-empty
+ * bin is taken.  Every block in a higher bin is larger than every block in a
+ * lower one, so under best fit the smallest block of that bin is still an
+ * exact best fit.  When no small block fits, or the request is itself large,
+ * the large-block tree answers in O(log n).
+ */
+static size_t * index_fit(arena *a, size_t size) {
+    size_t *result = 0;
+    int index = bin_index(size);
+    unsigned int candidates;
+
+    if (size >= LARGE_BLOCK_SIZE) {
+        return tree_fit(a, size);
+    }
+#if PLACEMENT == FIRST_FIT || PLACEMENT == NEXT_FIT
+    result = bin_first_fit(a, index, size);
+#else
+    /* Look for the tightest fit within the request's own size class. */
+    for (size_t *header = a->bins[index]; header != 0;
+         header = ((free_links *) (header + 1))->next) {
+        if (*header >= size && (!result || better_fit(header, result))) {
+            result = header;
+        }
+    }
+#endif
+    if (result) {
+        return result;
+    }
+
+    /* Otherwise anything in the next non-empty bin fits. */
+    candidates = a->binmap & ~((2u << index) - 1);
+    if (candidates == 0) {
+        return tree_fit(a, size);
+    }
+    index = __builtin_ctz(candidates);
+#if PLACEMENT == FIRST_FIT || PLACEMENT == NEXT_FIT
+    return bin_first_fit(a, index, 0);
+#else
+    for (size_t *header = a->bins[index]; header != 0;
+         header = ((free_links *) (header + 1))->next) {
+        if (!result || better_fit(header, result)) {
+            result = header;
+        }
+    }
+    return result;
+#endif
+}
+/*
+ * Returns a pointer to the header of the free block of at least "size" bytes
+ * that the placement policy picks, or 0 if there is none.  The top block is
+ * only used when nothing in the index fits, which preserves it for requests
+ * nothing else could serve, and keeps every choice the same however large
+ * the pool is.
+ */
+size_t * fit_block(arena *a, size_t size) {
+    size_t *result = index_fit(a, size);
+    if (result == 0 && a->top != 0 && *a->top >= size) {
+        result = a->top;
+    }
+    return result;
+}
+/*
+ * Takes a pointer to a header of a free block of memory and returns a
+ * pointer to the block's footer.
+ */
+size_t * get_footer(size_t *header) {
+    size_t size;
+    size = block_size(header);
+    header = (size_t *) ((unsigned char *) header + size - sizeof(size_t));
+    return header;
+}
+/*
+ * Takes a pointer to a header of a block memory and returns a pointer
+ * to the next block's header. If there is no next block, 0 is returned.
+ */
+size_t * get_next_header(arena *a, size_t *header) {
+    size_t size;
+    size = block_size(header);
+    header = (size_t *) ((unsigned char *) header + size);
+    /* Check if there is another header, or if end has been reached. */
+    if (header >= a->end) {
+        return 0x0;
+    }
+    return header;
+}
+/*
+ * Returns the slab page that ptr points into, or 0 if ptr is not inside a
+ * slab.  This is a constant time lookup in the slab map.
+ */
+slab * find_slab(arena *a, unsigned char *ptr) {
+    long offset = ptr - (unsigned char *) a->start;
+    if (offset < 0 || (size_t) offset / SLAB_SIZE >= a->num_pages
+        || !a->slab_map[offset / SLAB_SIZE]) {
+        return 0;
+    }
+    return (slab *) ((unsigned char *) a->start
+                     + (offset & ~(long) (SLAB_SIZE - 1)) + sizeof(size_t));
+}
+/*
+ * Returns the slab class an ordinary block of the given size would belong to;
+ * classes at or beyond NUM_SLAB_CLASSES are not served by slabs.
+ */
+static size_t block_class(size_t size) {
+    return (size - 2 * sizeof(size_t)) / ALIGNMENT - 1;
+}
+/*
+ * Returns the size of a slab descriptor whose bitmap covers "slots" slots,
+ * rounded up so that the slots after it stay aligned.
+ */
+static int slab_descriptor_size(int slots) {
+    int descriptor = sizeof(slab)
+                     + (slots + 63) / 64 * sizeof(unsigned long long);
+    return (descriptor + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+/*
+ * Returns how many slots of slot_size bytes fit in a slab page alongside its
+ * block header and descriptor, or 0 if that is no more than the number of
+ * ordinary blocks of the same class that would fit in the page.
+ */
+int slab_fit(int slot_size) {
+    int room = SLAB_SIZE - sizeof(size_t);
+    int slots = (room - sizeof(slab)) / slot_size;
+    int ordinary = (slot_size + sizeof(size_t) + ALIGNMENT - 1)
+                   & ~(ALIGNMENT - 1);
+
+    while (slab_descriptor_size(slots) + slots * slot_size > room) {
+        slots--;
+    }
+    if (ordinary < (int) MIN_BLOCK_SIZE) {
+        ordinary = MIN_BLOCK_SIZE;
+    }
+    if (slots * ordinary <= SLAB_SIZE) {
+        return 0;
+    }
+    return slots;
+}
+/* Returns a pointer to the first slot of a slab page. */
+static unsigned char * slab_slots(slab *page) {
+    return (unsigned char *) page + slab_descriptor_size(page->num_slots);
+}
+/* Pushes a slab onto the list of slabs with free slots for its class. */
+static void slab_link(arena *a, slab *page) {
+    int index = page->slot_size / ALIGNMENT - 1;
+    page->prev = 0;
+    page->next = a->partial_slabs[index];
+    if (page->next != 0) {
+        page->next->prev = page;
+    }
+    a->partial_slabs[index] = page;
+}
+/* Unlinks a slab from the list of slabs with free slots for its class. */
+static void slab_unlink(arena *a, slab *page) {
+    int index = page->slot_size / ALIGNMENT - 1;
+    if (page->prev != 0) {
+        page->prev->next = page->next;
+    }
+    else {
+        a->partial_slabs[index] = page->next;
+    }
+    if (page->next != 0) {
+        page->next->prev = page->prev;
+    }
+}
+/*
+ * Returns the first heap page inside the free block at header such that
+ * whatever is left over on either side of the page can stand on its own as a
+ * free block, or 0 if there is none.
+ */
+static size_t * block_page(arena *a, size_t *header) {
+    size_t lead;
+    size_t trail;
+    long offset;
+
+    /* Round up to the first page boundary inside this block. */
+    offset = (unsigned char *) header - (unsigned char *) a->start;
+    offset = (offset + SLAB_SIZE - 1) & ~(long) (SLAB_SIZE - 1);
+    lead = offset - ((unsigned char *) header - (unsigned char *) a->start);
+    if (lead != 0 && lead < MIN_BLOCK_SIZE) {
+        offset += SLAB_SIZE;
+        lead += SLAB_SIZE;
+    }
+    trail = *header - lead - SLAB_SIZE;
+    if (*header >= lead + SLAB_SIZE
+        && (trail == 0 || trail >= MIN_BLOCK_SIZE)) {
+        return (size_t *) ((unsigned char *) a->start + offset);
+    }
+    return 0;
+}
+/*
+ * A free block of at least PAGE_COVER_SIZE bytes always covers a whole heap
+ * page, wherever it starts.  find_free_page() tries at most PAGE_SEARCH_LIMIT
+ * smaller blocks before settling for the smallest block that size.
+ */
+#define PAGE_COVER_SIZE (2 * SLAB_SIZE + 2 * MIN_BLOCK_SIZE)
+#ifndef PAGE_SEARCH_LIMIT
+#define PAGE_SEARCH_LIMIT 8
+#endif
+/*
+ * Looks for a free block in the subtree rooted at root that covers a whole
+ * heap page, as block_page() does.  Only the large-block tree can hold such
+ * blocks, and it is searched in size order so the smallest suitable block is
+ * used, giving up once *tries blocks smaller than PAGE_COVER_SIZE have
+ * failed.  Returns the page's address, or 0 if there is none; *owner is set
+ * to the block containing the page.
+ */
+static size_t * find_free_page(arena *a, size_t *root, size_t **owner,
+                               int *tries) {
+    size_t *page;
+
+    if (root == 0 || *tries == 0) {
+        return 0;
+    }
+    if (*root >= SLAB_SIZE) {
+        page = find_free_page(a, get_node(root)->left, owner, tries);
+        if (page != 0 || *tries == 0) {
+            return page;
+        }
+        page = block_page(a, root);
+        if (page != 0) {
+            *owner = root;
+            return page;
+        }
+        (*tries)--;
+    }
+    return find_free_page(a, get_node(root)->right, owner, tries);
+}
+/* Finds a free page like find_free_page(), trying the top block last. */
+static size_t * find_page(arena *a, size_t **owner) {
+    int tries = PAGE_SEARCH_LIMIT;
+    size_t *page = find_free_page(a, a->tree_root, owner, &tries);
+    if (page == 0 && tries == 0) {
+        /* A lower-bound lookup finds a block that is sure to do. */
+        *owner = tree_best_fit(a, PAGE_COVER_SIZE);
+        if (*owner != 0) {
+            page = block_page(a, *owner);
+        }
+    }
+    if (page == 0 && a->top != 0 && *a->top >= SLAB_SIZE) {
+        page = block_page(a, a->top);
+        *owner = a->top;
+    }
+    return page;
+}
+/*
+ * Raises the high-water mark of an arena past a newly allocated block, and
+ * the start of the clean part of the heap with it.
+ */
+static void note_high_water(arena *a, size_t *header) {
+    size_t *end = (size_t *) ((unsigned char *) header + block_size(header));
+    if (end > a->high_water) {
+        a->high_water = end;
+    }
+    if ((unsigned char *) end > a->clean) {
+        a->clean = (unsigned char *) end;
+    }
+}
+/*
+ * Carves a new slab page for slots of slot_size bytes out of the heap, and
+ * returns its descriptor, or 0 if no free block covers a whole page.
+ */
+static slab * slab_create(arena *a, int slot_size) {
+    size_t *owner;
+    size_t *page = find_page(a, &owner);
+    size_t orig_size;
+    size_t lead;
+    int slots = slab_capacity[slot_size / ALIGNMENT - 1];
+    int words = (slots + 63) / 64;
+    slab *result;
+
+    if (page == 0) {
+        /* Grow the heap far enough that its top block covers a whole page. */
+        size_t *top = top_block(a);
+        long offset;
+        offset = (unsigned char *) top - (unsigned char *) a->start
+                 + MIN_BLOCK_SIZE;
+        offset = (offset + SLAB_SIZE - 1) & ~(long) (SLAB_SIZE - 1);
+        if (!arena_grow(a, (unsigned char *) a->start + offset + SLAB_SIZE
+                           + MIN_BLOCK_SIZE - (unsigned char *) top)) {
+            return 0;
+        }
+        page = find_page(a, &owner);
+        if (page == 0) {
+            return 0;
+        }
+    }
+    orig_size = *owner;
+    lead = (unsigned char *) page - (unsigned char *) owner;
+    remove_free_block(a, owner);
+    /* Give back whatever lies before and after the page. */
+    if (lead > 0) {
+        set_block_size(owner, lead);
+        insert_free_block(a, owner);
+    }
+    if (orig_size - lead > SLAB_SIZE) {
+        size_t *rest = (size_t *) ((unsigned char *) page + SLAB_SIZE);
+        set_block_size(rest, orig_size - lead - SLAB_SIZE);
+        insert_free_block(a, rest);
+    }
+    else {
+        set_prev_free((size_t *) ((unsigned char *) page + SLAB_SIZE), 0);
+    }
+    /* To the rest of the heap, the page is just an ordinary allocated block. */
+    *page = SLAB_SIZE | BLOCK_ALLOCATED | (lead > 0 ? PREV_FREE : 0);
+    note_high_water(a, page);
+    a->slab_map[((unsigned char *) page - (unsigned char *) a->start)
+                / SLAB_SIZE] = 1;
+
+    result = (slab *) (page + 1);
+    result->slot_size = slot_size;
+    result->num_slots = slots;
+    result->num_free = slots;
+    result->map_words = words;
+    for (int i = 0; i < words; i++) {
+        int bits = slots - 64 * i;
+        result->free_map[i] = bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+    }
+    slab_link(a, result);
+    return result;
+}
+/*
+ * Attempts to serve a small request from a slab of the matching size class.
+ * Returns 0 if there is no slab with a free slot and no room for a new one.
+ * Finding a free slot is a bit scan over the slab's bitmap.
+ */
+unsigned char * slab_alloc(arena *a, size_t size) {
+    int index = size <= ALIGNMENT ? 0 : (size - 1) / ALIGNMENT;
+    slab *page = a->partial_slabs[index];
+    int word = 0;
+    int bit;
+
+    if (page == 0) {
+        if (slab_capacity[index] == 0
+            || a->small_live[index] < SLAB_MIN_LIVE) {
+            return 0;
+        }
+        page = slab_create(a, (index + 1) * ALIGNMENT);
+        if (page == 0) {
+            return 0;
+        }
+    }
+    while (page->free_map[word] == 0) {
+        word++;
+    }
+    bit = __builtin_ctzll(page->free_map[word]);
+    page->free_map[word] &= ~(1ULL << bit);
+    page->num_free--;
+    if (page->num_free == 0) {
+        slab_unlink(a, page);
+    }
+    return slab_slots(page) + (64 * word + bit) * page->slot_size;
+}
+/*
+ * Returns a slot to its slab in constant time.  A slab that becomes entirely
+ * free is handed back to the heap as an ordinary free block.
+ */
+void slab_free(arena *a, slab *page, unsigned char *ptr) {
+    int slot = (ptr - slab_slots(page)) / page->slot_size;
+
+    page->free_map[slot / 64] |= 1ULL << (slot % 64);
+    if (page->num_free == 0) {
+        slab_link(a, page);
+    }
+    page->num_free++;
+    if (page->num_free == page->num_slots) {
+        size_t *header = (size_t *) page - 1;
+        slab_unlink(a, page);
+        a->slab_map[((unsigned char *) header - (unsigned char *) a->start)
+                 / SLAB_SIZE] = 0;
+        free_block(a, header);
+    }
+}
+/* Returns the most the heap of an arena could ever grow to. */
+static size_t arena_room(arena *a) {
+    return (unsigned char *) a->limit - (unsigned char *) a->start;
+}
+/*
+ * Adjusts the count of live ordinary blocks in the slab class of a block of
+ * the given size, if it has one.
+ */
+static void note_live(arena *a, size_t size, int delta) {
+    if (block_class(size) < NUM_SLAB_CLASSES) {
+        a->small_live[block_class(size)] += delta;
+    }
+}
+/*
+ * Frees every block on one quick list for real, coalescing each with its
+ * neighbours.
+ */
+static void quick_flush(arena *a, int index) {
+    while (a->quick[index] != 0) {
+        size_t *header = a->quick[index];
+        a->quick[index] = *(size_t **) (header + 1);
+        free_block(a, header);
+    }
+    a->quick_blocks -= a->quick_count[index];
+    a->quick_count[index] = 0;
+}
+/* Consolidates all the quick lists of an arena. */
+static void quick_consolidate(arena *a) {
+    for (int i = 0; i < NUM_QUICK_LISTS && a->quick_blocks > 0; i++) {
+        if (a->quick_count[i] > 0) {
+            quick_flush(a, i);
+        }
+    }
+}
+/*
+ * Returns a fit for a block of "size" bytes like fit_block(), but
+ * consolidates the quick lists and looks again before giving up, since their
+ * blocks may coalesce into a fit.
+ */
+static size_t * find_fit(arena *a, size_t size) {
+    size_t *header = fit_block(a, size);
+    if ((header == 0 || header == top_block(a)) && a->quick_blocks > 0) {
+        quick_consolidate(a);
+        header = fit_block(a, size);
+    }
+    return header;
+}
+/*
+ * Returns the size of the block needed to hold "size" bytes: room for the
+ * header, rounded up to keep payloads aligned.  Allocated blocks need no
+ * footer, but must be able to hold one once they are freed.
+ */
+static size_t block_needed(size_t size) {
+    size_t needed = (size + sizeof(size_t) + ALIGNMENT - 1)
+                    & ~(size_t) (ALIGNMENT - 1);
+    return needed < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : needed;
+}
+/*
+ * Takes the free block at header off its free list and allocates "needed"
+ * bytes of it, starting "lead" bytes in.  The lead, which must be 0 or large
+ * enough to be a block, stays free, and so does any remainder that can stand
+ * on its own as a free block.  Returns a pointer to the payload.
+ */
+static unsigned char * carve_block(arena *a, size_t *header, size_t lead,
+                                   size_t needed) {
+    size_t orig_size = *header;
+    size_t prev_free = lead > 0 ? PREV_FREE : 0;
+
+    /* Only blocks in the large-block tree know which of their pages are zero. */
+    last_carve.zero_from = 0;
+    last_carve.zero_to = 0;
+    if (header != a->top && orig_size >= LARGE_BLOCK_SIZE) {
+        last_carve.zero_from = get_node(header)->zero_from;
+        last_carve.zero_to = get_node(header)->zero_to;
+    }
+    remove_free_block(a, header);
+    if (lead > 0) {
+        set_block_size(header, lead);
+        insert_free_block(a, header);
+        header = (size_t *) ((unsigned char *) header + lead);
+        orig_size -= lead;
+        a->splits++;
+    }
+    /* Only split if the remainder can stand on its own as a free block. */
+    if (orig_size - needed >= MIN_BLOCK_SIZE) {
+        a->splits++;
+        /* Set the allocated header, and note whether the lead is free. */
+        *header = needed | BLOCK_ALLOCATED | prev_free;
+        /* The second block after the split goes back on a free list. */
+        size_t *rest = (size_t *) ((unsigned char *) header + needed);
+        set_block_size(rest, orig_size - needed);
+        insert_free_block(a, rest);
+    }
+    else {
+        /* If we don't split, the next block loses its free neighbour. */
+        size_t *footer = (size_t *) ((unsigned char *) header + orig_size) - 1;
+        *header = orig_size | BLOCK_ALLOCATED | prev_free;
+        set_prev_free(footer + 1, 0);
+        /* The top block's footer is all that keeps its tail from being clean. */
+        if ((unsigned char *) footer >= a->clean) {
+            *footer = 0;
+        }
+    }
+    last_carve.payload = (unsigned char *) (header + 1);
+    last_carve.clean = a->clean > last_carve.payload ? a->clean
+                                                     : last_carve.payload;
+    note_live(a, block_size(header), 1);
+    note_high_water(a, header);
+    /* Return a pointer to the payload. */
+    return (unsigned char *) (header + 1);
+}
+/*
+ * Allocates an ordinary block of "needed" bytes from the free-block index,
+ * growing the heap if nothing fits, and returns its payload, or 0 if that is
+ * not possible.  Slabs and quick lists are left out.
+ */
+static unsigned char * heap_alloc_block(arena *a, size_t needed) {
+    size_t *header = find_fit(a, needed);
+    if (header == 0 && arena_grow(a, needed)) {
+        header = fit_block(a, needed);
+    }
+    if (header == 0) {
+        return 0;
+    }
+    a->allocs++;
+    return carve_block(a, header, 0, needed);
+}
+/*
+ * Allocates a chunk of memory of "size" bytes from the heap, returning 0 if
+ * that is not possible.  Small requests are served from slabs when possible.
+ * Otherwise allocation only looks at free blocks of a suitable size class
+ * (as described in the comments above the best-fit function), rather than
+ * at every block in the pool.
+ */
+unsigned char * heap_alloc(arena *a, size_t size) {
+    size_t *header;
+    size_t needed;
+    unsigned char *result;
+
+    /* Nothing larger than the arena can fit, and the sizes cannot overflow. */
+    if (size > arena_room(a)) {
+        return 0;
+    }
+    if (size <= SLAB_MAX_SIZE) {
+        result = slab_alloc(a, size);
+        if (result != 0) {
+            a->allocs++;
+            return result;
+        }
+    }
+    needed = block_needed(size);
+    /* A recently freed block of just the right size needs no splitting. */
+    if (needed <= QUICK_MAX_SIZE && a->quick[needed / ALIGNMENT] != 0) {
+        header = a->quick[needed / ALIGNMENT];
+        a->quick[needed / ALIGNMENT] = *(size_t **) (header + 1);
+        a->quick_count[needed / ALIGNMENT]--;
+        a->quick_blocks--;
+        note_live(a, needed, 1);
+        a->allocs++;
+        return (unsigned char *) (header + 1);
+    }
+    /* Follow a best-fit strategy to find a memory block to allocate. */
+    return heap_alloc_block(a, needed);
+}
+/*
+ * Carves "count" consecutive blocks of "size" bytes each out of a single free
+ * block, found with one best-fit search, and stores their payloads in out[].
+ * The run is carved as one block and then cut up, so the last block takes any
+ * slack too small to stay free.  Small requests get ordinary blocks rather
+ * than slab slots, to keep the run contiguous.  Returns 0, allocating
+ * nothing, if no free block can hold the whole run.
+ */
+int heap_alloc_run(arena *a, size_t size, int count, unsigned char **out) {
+    size_t *header;
+    size_t needed;
+    size_t rest;
+
+    if (size > arena_room(a)) {
+        return 0;
+    }
+    needed = block_needed(size);
+    if ((size_t) count > arena_room(a) / needed) {
+        return 0;
+    }
+    header = find_fit(a, needed * count);
+    if (header == 0 && arena_grow(a, needed * count)) {
+        header = fit_block(a, needed * count);
+    }
+    if (header == 0) {
+        return 0;
+    }
+    header = (size_t *) carve_block(a, header, 0, needed * count) - 1;
+    rest = block_size(header);
+    note_live(a, rest, -1);
+    /* Without a lead, the block before the run is never free. */
+    for (int i = 0; i < count; i++) {
+        size_t piece = i < count - 1 ? needed : rest;
+        *header = piece | BLOCK_ALLOCATED;
+        note_live(a, piece, 1);
+        out[i] = (unsigned char *) (header + 1);
+        header = (size_t *) ((unsigned char *) header + piece);
+        rest -= piece;
+    }
+    a->allocs += count;
+    return 1;
+}
+/*
+ * Allocates "size" bytes whose address is a multiple of alignment, a power of
+ * two larger than ALIGNMENT.  A free block with room for the worst-case lead
+ * is found, and the fragment in front of the aligned payload is split off as
+ * a free block of its own, so nothing is lost to over-allocation.
+ */
+unsigned char * heap_alloc_aligned(arena *a, size_t size, size_t alignment) {
+    size_t *header;
+    size_t needed;
+    size_t search;
+    size_t lead;
+
+    if (size > arena_room(a) || alignment > arena_room(a)) {
+        return 0;
+    }
+    needed = block_needed(size);
+    search = needed + alignment + MIN_BLOCK_SIZE;
+    header = find_fit(a, search);
+    if (header == 0 && arena_grow(a, search)) {
+        header = fit_block(a, search);
+    }
+    if (header == 0) {
+        return 0;
+    }
+    /* The lead must either vanish or be large enough to be a free block. */
+    lead = -(uintptr_t) (header + 1) & (alignment - 1);
+    if (lead != 0 && lead < MIN_BLOCK_SIZE) {
+        lead += alignment;
+    }
+    a->allocs++;
+    return carve_block(a, header, lead, needed);
+}
+
+/*
+ * Notes that everything from header up to end is now one block, so that the
+ * compactor's cursor does not point into the middle of it.
+ */
+static void merge_cursor(arena *a, size_t *header, size_t *end) {
+    if (a->compact_cursor > header && a->compact_cursor < end) {
+        a->compact_cursor = header;
+    }
+}
+/*
+ * When a block is freed, this coalesces it with the block to its left, which
+ * has already been guaranteed to exist and be free.  The left block is taken
+ * off its free list; the coalesced block is not put on any list.
+ */
+size_t * back_coalesce(arena *a, size_t * header) {
+    /* Size of the just freed block. */
+    size_t right = *header;
+    /* Size of the block to the left. */
+    size_t left = *(header - 1);
+    /* Move to header of the coalesced block to set size. */
+    header = get_header(header - 1);
+    remove_free_block(a, header);
+    set_block_size(header, left + right);
+    merge_cursor(a, header, (size_t *) ((unsigned char *) header + *header));
+    a->coalesces++;
+    return header;
+}
+/*
+ * When a block is freed, this coalesces it with the block to its right, which
+ * has already been guaranteed to exist and be free.  The right block is taken
+ * off its free list; the coalesced block is not put on any list.
+ */
+void fwd_coalesce(arena *a, size_t * header) {
+    /* Size of the current block. */
+    size_t left = *header;
+    size_t *next = get_next_header(a, header);
+    /* Size of the block to the right. */
+    size_t right = *next;
+    remove_free_block(a, next);
+    set_block_size(header, left + right);
+    merge_cursor(a, header, (size_t *) ((unsigned char *) header + *header));
+    /* Coalescing into the top block leaves its old header behind. */
+    if ((unsigned char *) next >= a->clean) {
+        *next = 0;
+    }
+    a->coalesces++;
+}
+/*
+ * Trims the top block of an arena between from and to with trim_block().  If
+ * that stops less than a page short of the clean part of the heap, it goes on
+ * to where the heap is clean, so that the released pages join the clean part.
+ * That only holds if TRIM_ADVICE makes them read as zeros, as MADV_DONTNEED
+ * does; MADV_FREE may leave the data in place.
+ */
+static long trim_top(arena *a, unsigned char *from, unsigned char *to) {
+    unsigned char *first = (unsigned char *) (a->top + 1) + sizeof(tree_node);
+    long released;
+    if (to < a->clean && a->clean - to <= (long) a->page) {
+        to = page_round(a, a->clean);
+    }
+    released = trim_block(a, a->top, from, to);
+    if (from < first) {
+        from = first;
+    }
+    from = page_round(a, from);
+    if (released > 0 && TRIM_ADVICE == MADV_DONTNEED
+        && from < a->clean && from + released >= a->clean) {
+        a->clean = from;
+    }
+    return released;
+}
+/*
+ * Returns an allocated block to the heap, coalescing it with any free
+ * neighbours and putting the result on the appropriate free list.
+ */
+void free_block(arena *a, size_t *header) {
+    size_t *newptr = header;
+    size_t *next;
+    size_t size = block_size(header);
+    size_t prev_free = *header & PREV_FREE;
+    /* Designate header and footer of block as freed. */
+    set_block_size(newptr, size);
+    /* Check whether the block to the left is free. */
+    if (prev_free) {
+        newptr = back_coalesce(a, newptr);
+    }
+    /* Check that there is a block to the right and it is free. */
+    next = get_next_header(a, newptr);
+    if (next != 0) {
+        if (!(*next & BLOCK_ALLOCATED)) {
+            fwd_coalesce(a, newptr);
+        }
+    }
+    /* Whatever follows the free block now has a free neighbour. */
+    set_prev_free(get_footer(newptr) + 1, 1);
+    insert_free_block(a, newptr);
+    /*
+     * Only the freed span is trimmed, so a free costs what it released.  In
+     * the top block, the released pages may then become clean again.
+     */
+    if (TRIM_THRESHOLD > 0 && *newptr >= TRIM_THRESHOLD) {
+        if (newptr == a->top) {
+            trim_top(a, (unsigned char *) header,
+                     (unsigned char *) header + size);
+        }
+        else {
+            trim_block(a, newptr, (unsigned char *) header,
+                       (unsigned char *) header + size);
+        }
+    }
+}
+/*
+ * Releases the memory behind the whole pages between from and to that lie in
+ * a free block of an arena, keeping the header, the index node that follows
+ * it and the footer resident.  Returns the number of bytes released.  The
+ * pages read as zeros once they are reused, if TRIM_ADVICE is MADV_DONTNEED,
+ * and a block in the large-block tree remembers them for mycalloc(): one run
+ * of them, grown when the next trim touches it and replaced by a longer one.
+ * In an arena backed by huge pages, only whole huge pages are released, since
+ * releasing part of one would split it.
+ */
+long trim_block(arena *a, size_t *header, unsigned char *from,
+                unsigned char *to) {
+    unsigned char *first = (unsigned char *) (header + 1) + sizeof(tree_node);
+    unsigned char *last = (unsigned char *) get_footer(header);
+    long released;
+    if (from < first) {
+        from = first;
+    }
+    if (to > last) {
+        to = last;
+    }
+    from = page_round(a, from);
+    to = page_trunc(a, to);
+    if (to <= from || madvise(from, to - from, TRIM_ADVICE) != 0) {
+        return 0;
+    }
+    released = to - from;
+    if (TRIM_ADVICE == MADV_DONTNEED && header != a->top
+        && *header >= LARGE_BLOCK_SIZE) {
+        tree_node *node = get_node(header);
+        if (node->zero_to >= from && node->zero_from <= to) {
+            if (node->zero_from < from) {
+                from = node->zero_from;
+            }
+            if (node->zero_to > to) {
+                to = node->zero_to;
+            }
+        }
+        if (to - from > node->zero_to - node->zero_from) {
+            node->zero_from = from;
+            node->zero_to = to;
+        }
+    }
+    return released;
+}
+/*
+ * Trims every free block in a large-block subtree.  Smaller blocks cannot
+ * hold a whole page, so the free-list bins never need to be visited.
+ */
+static long trim_tree(arena *a, size_t *root) {
+    if (root == 0) {
+        return 0;
+    }
+    return trim_block(a, root, (unsigned char *) root,
+                      (unsigned char *) root + *root)
+           + trim_tree(a, get_node(root)->left)
+           + trim_tree(a, get_node(root)->right);
+}
+/*
+ * Returns a chunk of memory obtained from heap_alloc() to the heap.  Slab
+ * slots go straight back to their slab without touching any boundary tags,
+ * and small blocks go on a quick list.
+ */
+void heap_free(arena *a, unsigned char *ptr) {
+    slab *page = find_slab(a, ptr);
+    size_t *header;
+    size_t size;
+    a->frees++;
+    if (page != 0) {
+        slab_free(a, page, ptr);
+        return;
+    }
+    header = (size_t *) ptr - 1;
+    size = block_size(header);
+    note_live(a, size, -1);
+    /* Small blocks wait on a quick list, still marked as allocated. */
+    if (size <= QUICK_MAX_SIZE) {
+        int index = size / ALIGNMENT;
+        *(size_t **) ptr = a->quick[index];
+        a->quick[index] = header;
+        a->quick_blocks++;
+        if (++a->quick_count[index] > QUICK_COUNT) {
+            quick_flush(a, index);
+        }
+        return;
+    }
+    free_block(a, header);
+    /* A large free is a good moment to let the quick lists coalesce too. */
+    if (size >= LARGE_BLOCK_SIZE && a->quick_blocks > 0) {
+        quick_consolidate(a);
+    }
+}
+/*
+ * Frees ptrs[first], along with the chunks after it in the sorted array for
+ * as long as each one's block directly follows the last in the heap.  The
+ * whole run is joined into one block first, so it is coalesced with its
+ * neighbours and put on a free list only once.  Returns the index of the
+ * first chunk that was not freed.
+ */
+int heap_free_run(arena *a, unsigned char **ptrs, int first, int n) {
+    slab *page = find_slab(a, ptrs[first]);
+    size_t *header = (size_t *) ptrs[first] - 1;
+    size_t total;
+    int i = first + 1;
+
+    if (page != 0) {
+        slab_free(a, page, ptrs[first]);
+        a->frees++;
+        return i;
+    }
+    total = block_size(header);
+    note_live(a, total, -1);
+    while (i < n && ptrs[i] == (unsigned char *) header + total
+                               + sizeof(size_t)
+           && find_slab(a, ptrs[i]) == 0) {
+        size_t size = block_size((size_t *) ptrs[i] - 1);
+        note_live(a, size, -1);
+        total += size;
+        i++;
+    }
+    *header = total | BLOCK_ALLOCATED | (*header & PREV_FREE);
+    merge_cursor(a, header, (size_t *) ((unsigned char *) header + total));
+    free_block(a, header);
+    a->frees += i - first;
+    return i;
+}
+/*
+ * Resizes a chunk obtained from heap_alloc() in place, if that is possible,
+ * and returns 1; otherwise returns 0 and leaves the chunk alone.  A shrinking
+ * block gives its tail back to the heap.  A growing block absorbs its right
+ * neighbour if that is free and large enough, much as fwd_coalesce() would;
+ * at the top of the heap, the heap is grown under it first.  A slab slot can
+ * only hold as much as its slot size.
+ */
+int heap_resize(arena *a, unsigned char *ptr, size_t size) {
+    slab *page = find_slab(a, ptr);
+    size_t *header = (size_t *) ptr - 1;
+    size_t *next;
+    size_t current;
+    size_t needed;
+    size_t total;
+
+    if (page != 0) {
+        return size <= page->slot_size;
+    }
+    if (size > arena_room(a)) {
+        return 0;
+    }
+    current = block_size(header);
+    needed = block_needed(size);
+    total = current;
+    if (needed > current) {
+        /* At the top of the heap, make the free space after the block fit. */
+        next = (size_t *) ((unsigned char *) header + current);
+        if (next == top_block(a)
+            && (next == a->end || *next < needed - current)) {
+            size_t grow = needed - current;
+            arena_grow(a, grow < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : grow);
+        }
+        next = get_next_header(a, header);
+        if (next == 0 || (*next & BLOCK_ALLOCATED)
+            || current + *next < needed) {
+            return 0;
+        }
+        total += *next;
+        remove_free_block(a, next);
+        merge_cursor(a, header,
+                     (size_t *) ((unsigned char *) header + total));
+    }
+    note_live(a, current, -1);
+    /* Keep what is needed, and give back any tail that can be a free block. */
+    if (total - needed >= MIN_BLOCK_SIZE) {
+        size_t *rest = (size_t *) ((unsigned char *) header + needed);
+        *header = needed | BLOCK_ALLOCATED | (*header & PREV_FREE);
+        *rest = (total - needed) | BLOCK_ALLOCATED;
+        free_block(a, rest);
+        a->splits++;
+    }
+    else if (total != current) {
+        *header = total | BLOCK_ALLOCATED | (*header & PREV_FREE);
+        set_prev_free((size_t *) ((unsigned char *) header + total), 0);
+    }
+    note_live(a, block_size(header), 1);
+    note_high_water(a, header);
+    return 1;
+}
+/*
+ * Runs one slice of compaction over the heap of an arena, walking it from the
+ * compactor's cursor by way of the boundary tags.  Whenever a free block is
+ * followed by a movable block that is not pinned, the block slides down to
+ * the start of the free block, and the free space after it coalesces with
+ * whatever free block follows, so that free space drifts up towards the top
+ * of the heap, where it can be trimmed.  Every byte moved and every block
+ * stepped over count against *budget, and the slice stops once that runs out.
+ * Returns 1 if the walk reached the end of the heap, starting the cursor over.
+ */
+static int compact_slice(arena *a, long *budget) {
+    size_t *header = a->compact_cursor != 0 ? a->compact_cursor : a->start;
+
+    while (header < a->end) {
+        size_t *next = (size_t *) ((unsigned char *) header
+                                   + block_size(header));
+        myalloc_handle_t handle;
+        int idle = 0;
+
+        if (*budget <= 0) {
+            a->compact_cursor = header;
+            return 0;
+        }
+        *budget -= MIN_BLOCK_SIZE;
+        if ((*header & BLOCK_ALLOCATED) || next >= a->end
+            || !(*next & MOVABLE)) {
+            header = next;
+            continue;
+        }
+        /* The chunk stays where it is while anybody has it pinned. */
+        handle = *(myalloc_handle_t *) (next + 1);
+        if (!__atomic_compare_exchange_n(&handle->pins, &idle, -1, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            header = next;
+            continue;
+        }
+        {
+            size_t gap = *header;
+            size_t size = block_size(next);
+            size_t *rest = (size_t *) ((unsigned char *) header + size);
+            remove_free_block(a, header);
+            memmove(header, next, size);
+            /* The block before a free block is never free itself. */
+            *header = size | BLOCK_ALLOCATED | MOVABLE;
+            handle->payload = (unsigned char *) (header + 1);
+            __atomic_store_n(&handle->pins, 0, __ATOMIC_RELEASE);
+            /* The gap moves up, merging with any free block beyond it. */
+            *rest = gap | BLOCK_ALLOCATED;
+            free_block(a, rest);
+            a->compacted += size;
+            *budget -= size;
+            header = rest;
+        }
+    }
+    a->compact_cursor = 0;
+    return 1;
+}
+/*
+ * Returns the number of bytes that can be stored in an allocated chunk, which
+ * may be more than was asked for.
+ */
+size_t usable_size(unsigned char *ptr) {
+    slab *page;
+    if (is_mapped(ptr)) {
+        mapped_header *header = (mapped_header *) ptr - 1;
+        return header->length - header->offset - sizeof(mapped_header);
+    }
+    page = find_slab(arena_of(&default_pool, ptr), ptr);
+    if (page != 0) {
+        return page->slot_size;
+    }
+    return block_size((size_t *) ptr - 1) - sizeof(size_t);
+}
+/*
+ * Returns 1 if ptr was handed out by mapped_alloc().  Mapped blocks are the
+ * only ones outside the default pool, so the boundary-tag code never sees
+ * them.
+ */
+int is_mapped(unsigned char *ptr) {
+    return ptr < default_pool.mem
+           || ptr >= default_pool.mem + default_pool.size;
+}
+/*
+ * Adds to the bytes mapped on their own, raising the peak with them.  This
+ * takes no lock, so the peak is raised with a CAS.
+ */
+static void note_mapped(size_t length) {
+    size_t total = __atomic_add_fetch(&mapped_bytes, length, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&mapped_peak, __ATOMIC_RELAXED);
+    while (total > peak
+           && !__atomic_compare_exchange_n(&mapped_peak, &peak, total, 1,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED)) {
+    }
+}
+/* Returns 1 if a request of "size" bytes should be mapped on its own. */
+static int maps_own(size_t size) {
+    size_t threshold = __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+    return threshold != 0 && size >= threshold;
+}
+/*
+ * Serves a huge request with a fresh mapping of its own, preceded by a
+ * mapped_header, and with the payload aligned to "alignment" bytes.  Mappings
+ * are page aligned, so only larger alignments need any slack in front.
+ * Returns 0 if the system has no memory left to map.
+ */
+unsigned char * mapped_alloc(size_t size, size_t alignment) {
+    size_t slack = alignment - 1;
+    size_t length = (sizeof(mapped_header) + slack + size + page_size - 1)
+                    & ~(page_size - 1);
+    unsigned char *base;
+    unsigned char *payload;
+    mapped_header *header;
+
+    /* A length that wrapped around could never be mapped anyway. */
+    if (length < size) {
+        return 0;
+    }
+    base = mmap(0, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return 0;
+    }
+    payload = base + sizeof(mapped_header);
+    payload += -(uintptr_t) payload & (alignment - 1);
+    header = (mapped_header *) payload - 1;
+    header->length = length;
+    header->offset = (unsigned char *) header - base;
+    header->size = 0;
+    note_mapped(length);
+    __atomic_add_fetch(&mapped_allocs, 1, __ATOMIC_RELAXED);
+    return payload;
+}
+/* Returns the memory of a mapped block straight to the system. */
+void mapped_free(unsigned char *ptr) {
+    mapped_header *header = (mapped_header *) ptr - 1;
+    __atomic_sub_fetch(&mapped_bytes, header->length, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mapped_frees, 1, __ATOMIC_RELAXED);
+    munmap((unsigned char *) header - header->offset, header->length);
+}
+/*
+ * Resizes a mapped block with mremap(), which lets the system move its pages
+ * rather than copying them.  Returns the new payload, or 0 if that fails, in
+ * which case the block is left as it was.
+ */
+unsigned char * mapped_realloc(unsigned char *ptr, size_t size) {
+    mapped_header *header = (mapped_header *) ptr - 1;
+    size_t offset = header->offset;
+    size_t old_length = header->length;
+    size_t length = (offset + sizeof(mapped_header) + size + page_size - 1)
+                    & ~(page_size - 1);
+    unsigned char *base;
+    if (length < size) {
+        return 0;
+    }
+    base = mremap((unsigned char *) header - offset, old_length, length,
+                  MREMAP_MAYMOVE);
+    if (base == MAP_FAILED) {
+        return 0;
+    }
+    if (length >= old_length) {
+        note_mapped(length - old_length);
+    }
+    else {
+        __atomic_sub_fetch(&mapped_bytes, old_length - length,
+                           __ATOMIC_RELAXED);
+    }
+    header = (mapped_header *) (base + offset);
+    header->length = length;
+    return (unsigned char *) (header + 1);
+}
+
+#ifdef MYALLOC_THREADS
+/*
+ * Returns up to "count" blocks from the head of a cache class to the heap.
+ * Each block goes back to its own arena; the lock is only switched when
+ * consecutive blocks come from different arenas.
+ */
+static void tcache_flush(tcache *cache, int index, int count) {
+    arena *locked = 0;
+    while (count-- > 0 && cache->head[index] != 0) {
+        unsigned char *block = cache->head[index];
+        arena *a = arena_of(&default_pool, block);
+        cache->head[index] = *(unsigned char **) block;
+        cache->count[index]--;
+        if (a != locked) {
+            if (locked != 0) {
+                unlock_arena(locked);
+            }
+            lock_arena(a);
+            locked = a;
+        }
+        heap_free(a, block);
+    }
+    if (locked != 0) {
+        unlock_arena(locked);
+    }
+}
+/* Hands everything a thread has cached back to the heap. */
+static void tcache_release(void *arg) {
+    tcache *cache = (tcache *) arg;
+    if (cache->generation != pool_generation) {
+        return;
+    }
+    for (int i = 0; i < NUM_TCACHE_CLASSES; i++) {
+        if (cache->count[i] > 0) {
+            tcache_flush(cache, i, cache->count[i]);
+        }
+    }
+}
+static void tcache_make_key() {
+    /* The same routine flushes the cache when its thread exits. */
+    pthread_key_create(&cache_key, tcache_release);
+}
+/*
+ * Returns the calling thread's cache, first discarding its contents if they
+ * belong to a pool that has since been replaced.
+ */
+static tcache * get_tcache() {
+    tcache *cache = &thread_cache;
+    if (cache->generation != pool_generation) {
+        pthread_once(&cache_key_once, tcache_make_key);
+        pthread_setspecific(cache_key, cache);
+        for (int i = 0; i < NUM_TCACHE_CLASSES; i++) {
+            cache->head[i] = 0;
+            cache->count[i] = 0;
+        }
+        cache->generation = pool_generation;
+    }
+    return cache;
+}
+/*
+ * Serves a request from the thread cache, refilling an empty class with a
+ * batch of blocks taken from the thread's arena under a single lock
+ * acquisition.  If that arena is exhausted, the request alone is passed on
+ * to the other arenas.
+ */
+static unsigned char * tcache_alloc(size_t size) {
+    tcache *cache = get_tcache();
+    int index = size <= ALIGNMENT ? 0 : (size - 1) / ALIGNMENT;
+    unsigned char *result = cache->head[index];
+    arena *a;
+
+    if (result != 0) {
+        cache->head[index] = *(unsigned char **) result;
+        cache->count[index]--;
+        return result;
+    }
+    a = local_arena(&default_pool);
+    lock_arena(a);
+    drain_remote_frees(a);
+    result = heap_alloc(a, (index + 1) * ALIGNMENT);
+    if (result != 0) {
+        for (int i = 1; i < TCACHE_BATCH; i++) {
+            unsigned char *block = heap_alloc(a, (index + 1) * ALIGNMENT);
+            if (block == 0) {
+                break;
+            }
+            *(unsigned char **) block = cache->head[index];
+            cache->head[index] = block;
+            cache->count[index]++;
+        }
+    }
+    unlock_arena(a);
+    if (result == 0) {
+        /* The pool may still fit the exact size, if not the whole class. */
+        result = arena_alloc(&default_pool, size, ALIGNMENT);
+    }
+    return result;
+}
+/*
+ * Caches a freed block in the calling thread, or returns 0 if it is too large
+ * to be cached.  Once a class fills up, half of it is given back to the heap.
+ * Only blocks from the thread's own arena are cached.
+ */
+static int tcache_free(unsigned char *ptr) {
+    tcache *cache;
+    int index = usable_size(ptr) / ALIGNMENT - 1;
+
+    if (index >= NUM_TCACHE_CLASSES) {
+        return 0;
+    }
+    cache = get_tcache();
+    *(unsigned char **) ptr = cache->head[index];
+    cache->head[index] = ptr;
+    cache->count[index]++;
+    if (cache->count[index] > TCACHE_COUNT) {
+        tcache_flush(cache, index, TCACHE_COUNT / 2);
+    }
+    return 1;
+}
+#endif
+
+/*
+ * Writes a diagnostic line straight to standard error, with a single write()
+ * that takes none of the locks of stdio.
+ */
+static void write_diagnostic(const char *message) {
+    char line[DIAGNOSTIC_LENGTH + 1];
+    size_t length = strnlen(message, DIAGNOSTIC_LENGTH);
+    ssize_t written;
+    memcpy(line, message, length);
+    line[length] = '\n';
+    /* There is nowhere left to report a failed write. */
+    written = write(STDERR_FILENO, line, length + 1);
+    (void) written;
+}
+/* Returns the time in milliseconds on a clock that never goes back. */
+static long now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+/*
+ * Formats a diagnostic and passes it to the diagnostic hook, unless one was
+ * passed on less than diagnostic_interval milliseconds ago, in which case it
+ * is only counted.  Only one of any number of threads racing here wins.
+ */
+static void diagnose(const char *format, ...) {
+    char message[DIAGNOSTIC_LENGTH];
+    long now = now_ms();
+    long last = __atomic_load_n(&last_diagnostic, __ATOMIC_RELAXED);
+    myalloc_diagnostic_hook_t hook;
+    unsigned long held;
+    va_list args;
+    int length;
+
+    if ((last >= 0 && now - last < diagnostic_interval)
+        || !__atomic_compare_exchange_n(&last_diagnostic, &last, now, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&held_diagnostics, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    va_start(args, format);
+    length = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    held = __atomic_exchange_n(&held_diagnostics, 0, __ATOMIC_RELAXED);
+    if (held > 0 && length >= 0 && (size_t) length < sizeof(message)) {
+        snprintf(message + length, sizeof(message) - length,
+                 " (%lu similar messages held back)", held);
+    }
+    hook = __atomic_load_n(&diagnostic_hook, __ATOMIC_RELAXED);
+    (hook != 0 ? hook : write_diagnostic)(message);
+}
+/*
+ * Makes one attempt at allocating "size" bytes at a multiple of alignment from
+ * a pool, returning 0 if that fails.  In the default pool, huge requests
+ * bypass the pool and are mapped directly, and in the thread-safe build small
+ * requests are served from the calling thread's cache without taking any
+ * lock; if the pool turns out to be full, the thread's cache is flushed
+ * first, since its blocks might coalesce into a fit.
+ */
+static unsigned char * try_alloc(pool_t *pool, size_t size, size_t alignment) {
+    unsigned char *result;
+    if (pool != &default_pool) {
+        return arena_alloc(pool, size, alignment);
+    }
+    if (maps_own(size)) {
+        return mapped_alloc(size, alignment);
+    }
+#ifdef MYALLOC_THREADS
+    if (size <= TCACHE_MAX_SIZE && alignment <= ALIGNMENT) {
+        result = tcache_alloc(size);
+    }
+    else {
+        result = arena_alloc(pool, size, alignment);
+    }
+    if (result == 0) {
+        tcache_release(get_tcache());
+        result = arena_alloc(pool, size, alignment);
+    }
+#else
+    result = arena_alloc(pool, size, alignment);
+#endif
+    return result;
+}
+/*
+ * Deals with a request of "size" bytes at a multiple of alignment that a pool
+ * could not serve, as the out-of-memory handler asks: by trying again after
+ * it has reclaimed memory, by mapping the chunk on its own outside the pool
+ * (only in the default pool, since chunks of other pools must stay in their
+ * reservation), or by failing quietly.  Without a handler, the failure is
+ * reported through diagnose() on behalf of "caller".
+ */
+static unsigned char * out_of_memory(pool_t *pool, size_t size,
+                                     size_t alignment, const char *caller) {
+    myalloc_oom_handler_t handler = __atomic_load_n(&oom_handler,
+                                                    __ATOMIC_RELAXED);
+    unsigned char *result = 0;
+
+    if (handler == 0) {
+        diagnose("%s: cannot service request of size %zu", caller, size);
+        return 0;
+    }
+    for (int attempt = 1; result == 0; attempt++) {
+        int action = handler(size, attempt);
+        /* The handler may have freed whatever block it carved. */
+        last_carve.payload = 0;
+        switch (action) {
+            case MYALLOC_OOM_RETRY:
+                result = try_alloc(pool, size, alignment);
+                break;
+
+            case MYALLOC_OOM_GROW:
+                if (pool != &default_pool) {
+                    return 0;
+                }
+                return mapped_alloc(size, alignment);
+
+            default:
+                return 0;
+        }
+    }
+    return result;
+}
+/*!
+ * Attempt to allocate a chunk of memory of "size" bytes from a pool.  Return 0
+ * if allocation fails, after consulting the out-of-memory handler.  Every
+ * chunk of a pool other than the default one lies within the pool's
+ * reservation, so that pool_reset() can take them all back at once.
+ */
+unsigned char * pool_alloc(pool_t *pool, size_t size) {
+    unsigned char *result = try_alloc(pool, size, ALIGNMENT);
+    if (result == 0) {
+        result = out_of_memory(pool, size, ALIGNMENT,
+                               pool == &default_pool ? "myalloc"
+                                                     : "pool_alloc");
+    }
+    return result;
+}
+static void lock_profile() {
+#ifdef MYALLOC_THREADS
+    pthread_mutex_lock(&profile_lock);
+#endif
+}
+static void unlock_profile() {
+#ifdef MYALLOC_THREADS
+    pthread_mutex_unlock(&profile_lock);
+#endif
+}
+/*
+ * Returns the number of bytes to allocate before the next sample, drawn from
+ * an exponential distribution with the given mean, so that sampling every
+ * byte with the same small probability is simulated at the cost of one
+ * subtraction per allocation.  The logarithm is approximated without libm.
+ */
+static long sample_interval(size_t period) {
+    unsigned long bits;
+    int exponent;
+    double mantissa;
+    double t;
+    double log_u;
+
+    /* A xorshift generator, seeded differently for every thread. */
+    if (sample_random == 0) {
+        sample_random = (uintptr_t) &sample_random ^ now_ms() ^ 1;
+    }
+    sample_random ^= sample_random << 13;
+    sample_random ^= sample_random >> 7;
+    sample_random ^= sample_random << 17;
+    /* u = bits / 2^53 lies in (0, 1]; take ln u = ln(2^e * m). */
+    bits = (sample_random >> 11) + 1;
+    exponent = 63 - __builtin_clzl(bits);
+    mantissa = (double) bits / (double) (1UL << exponent);
+    t = (mantissa - 1) / (mantissa + 1);
+    log_u = (exponent - 53) * 0.6931471805599453
+            + 2 * t * (1 + t * t * (1.0 / 3 + t * t * (1.0 / 5 + t * t / 7)));
+    return (long) (-log_u * period) + 1;
+}
+/* Returns the hash chain an address of a live sample is kept on. */
+static int sample_bucket(unsigned char *ptr) {
+    return ((uintptr_t) ptr / ALIGNMENT) % PROFILE_MAX_SAMPLES;
+}
+/*
+ * Returns the entry for the stack of "depth" frames, adding it if it is new,
+ * or 0 if the table is full.  The profile must be locked.
+ */
+static int find_stack(void **frames, int depth) {
+    unsigned long hash = depth;
+    int bucket;
+    int index;
+
+    for (int i = 0; i < depth; i++) {
+        hash = (hash * 31) ^ (uintptr_t) frames[i];
+    }
+    bucket = hash % PROFILE_MAX_STACKS;
+    for (index = profile->stack_heads[bucket]; index != 0;
+         index = profile->stacks[index - 1].next) {
+        profile_stack *stack = &profile->stacks[index - 1];
+        if (stack->hash == hash && stack->depth == depth
+            && memcmp(stack->frames, frames, depth * sizeof(void *)) == 0) {
+            return index;
+        }
+    }
+    if (profile->num_stacks == PROFILE_MAX_STACKS) {
+        return 0;
+    }
+    index = ++profile->num_stacks;
+    profile->stacks[index - 1].hash = hash;
+    profile->stacks[index - 1].depth = depth;
+    memcpy(profile->stacks[index - 1].frames, frames, depth * sizeof(void *));
+    profile->stacks[index - 1].next = profile->stack_heads[bucket];
+    profile->stack_heads[bucket] = index;
+    return index;
+}
+/*
+ * Records a sample of "size" bytes at ptr and marks the chunk as sampled.
+ * The frames of this function, sample_alloc() and myalloc() are left off
+ * the stack; none of the three calls the next in tail position, so they are
+ * always there.
+ */
+static __attribute__((noinline)) void record_sample(unsigned char *ptr,
+                                                    size_t size) {
+    void *frames[PROFILE_DEPTH + 3];
+    int depth = backtrace(frames, PROFILE_DEPTH + 3) - 3;
+    int stack;
+    int index = 0;
+
+    lock_profile();
+    stack = find_stack(frames + 3, depth < 0 ? 0 : depth);
+    if (stack != 0 && profile->free_samples != 0) {
+        index = profile->free_samples;
+        profile->free_samples = profile->samples[index - 1].next;
+    }
+    else if (stack != 0 && profile->num_samples < PROFILE_MAX_SAMPLES) {
+        index = ++profile->num_samples;
+    }
+    if (index == 0) {
+        profile->dropped++;
+        unlock_profile();
+        return;
+    }
+    profile->samples[index - 1].ptr = ptr;
+    profile->samples[index - 1].size = size;
+    profile->samples[index - 1].time = now_ms();
+    profile->samples[index - 1].stack = stack;
+    profile->samples[index - 1].next = profile->sample_heads[sample_bucket(ptr)];
+    profile->sample_heads[sample_bucket(ptr)] = index;
+    profile->stacks[stack - 1].live_count++;
+    profile->stacks[stack - 1].live_bytes += size;
+    profile->stacks[stack - 1].total_count++;
+    profile->stacks[stack - 1].total_bytes += size;
+    unlock_profile();
+    *((size_t *) ptr - 1) |= SAMPLED;
+}
+/*
+ * Returns 1 if ptr, a chunk of the default pool, carries the SAMPLED flag.
+ * Slab slots are excluded first, since they have no word of their own
+ * before the payload.
+ */
+static int is_sampled(unsigned char *ptr) {
+    if (!is_mapped(ptr) && find_slab(arena_of(&default_pool, ptr), ptr) != 0) {
+        return 0;
+    }
+    return (*((size_t *) ptr - 1) & SAMPLED) != 0;
+}
+/* Drops the sample taken at ptr, if the profile still has it. */
+static void forget_sample(unsigned char *ptr) {
+    int *link;
+
+    lock_profile();
+    for (link = &profile->sample_heads[sample_bucket(ptr)]; *link != 0;
+         link = &profile->samples[*link - 1].next) {
+        profile_sample *sample = &profile->samples[*link - 1];
+        if (sample->ptr == ptr) {
+            int index = *link;
+            profile->stacks[sample->stack - 1].live_count--;
+            profile->stacks[sample->stack - 1].live_bytes -= sample->size;
+            *link = sample->next;
+            sample->next = profile->free_samples;
+            profile->free_samples = index;
+            break;
+        }
+    }
+    unlock_profile();
+}
+/*
+ * Clears the SAMPLED flag of a chunk that is about to be freed or has been
+ * resized, and drops its sample.
+ */
+static void drop_sample(unsigned char *ptr) {
+    *((size_t *) ptr - 1) &= ~(size_t) SAMPLED;
+    forget_sample(ptr);
+}
+/* Drops the sample of a chunk of the default pool, if it was sampled. */
+static void unsample(unsigned char *ptr) {
+    if (__atomic_load_n(&profile_used, __ATOMIC_RELAXED) && is_sampled(ptr)) {
+        drop_sample(ptr);
+    }
+}
+/*
+ * Forgets every live sample at once, when the chunks of the default pool are
+ * all thrown away; the totals of every stack remain.
+ */
+void forget_samples() {
+    if (profile == 0) {
+        return;
+    }
+    lock_profile();
+    for (int i = 0; i < profile->num_stacks; i++) {
+        profile->stacks[i].live_count = 0;
+        profile->stacks[i].live_bytes = 0;
+    }
+    memset(profile->sample_heads, 0, sizeof(profile->sample_heads));
+    profile->num_samples = 0;
+    profile->free_samples = 0;
+    unlock_profile();
+}
+/*
+ * The slow path of myalloc(), taken whenever the calling thread's countdown
+ * to its next sample runs out: allocates "size" bytes, sampling them if the
+ * profiler is running, and starts a new countdown.
+ */
+static __attribute__((noinline)) unsigned char * sample_alloc(size_t size) {
+    size_t period = __atomic_load_n(&profile_period, __ATOMIC_RELAXED);
+    unsigned char *result;
 
+    if (period == 0) {
+        sample_countdown = PROFILE_RECHECK;
+        return pool_alloc(&default_pool, size);
+    }
+    sample_countdown = sample_interval(period);
+    result = pool_alloc(&default_pool,
+                        size < PROFILE_MIN_SIZE ? PROFILE_MIN_SIZE : size);
+    if (result != 0) {
+        record_sample(result, size);
+    }
+    return result;
+}
 /*!
- * These variables are used to specify the size and address of the memory pool
- * that the simple allocator works against.  The memory pool is allocated within
- * init_myalloc(), and then myalloc() and free() work against this pool of
- * memory that mem points to.
+ * Attempt to allocate a chunk of memory of "size" bytes from the default
+ * pool.  Return 0 if allocation fails.  Counting down to the heap profiler's
+ * next sample is all this adds to pool_alloc().
  */
+unsigned char *myalloc(size_t size) {
+    if ((sample_countdown -= (long) size) < 0) {
+        unsigned char *result = sample_alloc(size);
+        /* Keep the call out of tail position, for record_sample(). */
+        __asm__ volatile ("" ::: "memory");
+        return result;
+    }
+    return pool_alloc(&default_pool, size);
+}
+/*!
+ * Attempt to allocate a chunk of memory of "size" bytes whose address is a
+ * multiple of alignment, which must be a power of two; page and cache-line
+ * alignments are typical.  Return 0 if allocation fails.  The space in front
+ * of the chunk stays free for other allocations, and the chunk is released
+ * with myfree() like any other.
+ */
+unsigned char *myalloc_aligned(size_t size, size_t alignment) {
+    unsigned char *result;
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        diagnose("myalloc_aligned: alignment %zu is not a power of two",
+                 alignment);
+        return 0;
+    }
+    if (alignment <= ALIGNMENT) {
+        return myalloc(size);
+    }
+    result = try_alloc(&default_pool, size, alignment);
+    if (result == 0) {
+        result = out_of_memory(&default_pool, size, alignment,
+                               "myalloc_aligned");
+    }
+    return result;
+}
+/*!
+ * Attempt to allocate zeroed room for "count" objects of "size" bytes each from
+ * the default pool.  Return 0 if allocation fails, or the total size does not
+ * fit in a size_t.  Only what may still hold old data is cleared: a mapped
+ * chunk is fresh from the system, a chunk carved where the heap is clean is
+ * cleared only up to where the clean part began, and the pages that were
+ * trimmed while its block was free are skipped.
+ */
+unsigned char *mycalloc(size_t count, size_t size) {
+    unsigned char *result;
+    unsigned char *clean;
+    size_t total;
 
-int MEMORY_SIZE;
-/* Always points to beginning of the entire memory pool. */
-unsigned char *mem;
-/* Always points to the end of the entire memory pool. */
-static int *end;
-
+    if (__builtin_mul_overflow(count, size, &total)) {
+        diagnose("mycalloc: cannot service request of %zu objects of size %zu",
+                 count, size);
+        return 0;
+    }
+    last_carve.payload = 0;
+    result = myalloc(total);
+    if (result == 0 || is_mapped(result)) {
+        return result;
+    }
+    clean = result + total;
+    if (last_carve.payload != result) {
+        memset(result, 0, total);
+        return result;
+    }
+    if (last_carve.clean < clean) {
+        clean = last_carve.clean;
+    }
+    /* Pages trimmed while the block was free need no clearing either. */
+    if (last_carve.zero_from < clean && last_carve.zero_to > result) {
+        unsigned char *from = last_carve.zero_from > result
+                              ? last_carve.zero_from : result;
+        if (last_carve.zero_to < clean) {
+            memset(last_carve.zero_to, 0, clean - last_carve.zero_to);
+        }
+        clean = from;
+    }
+    memset(result, 0, clean - result);
+    return result;
+}
 /*!
- * This function initializes both the allocator state, and the memory pool.  It
- * must be called before myalloc() or myfree() will work at all.
- *
- * Note that we allocate the entire memory pool using malloc().  This is so we
- * can create different memory-pool sizes for testing.  Obviously, in a real
- * allocator, this memory pool would either be a fixed memory region, or the
- * allocator would request a memory region from the operating system (see the
- * C standard function sbrk(), for example).
+ * Resize a chunk obtained from myalloc() to "size" bytes, keeping its contents
+ * up to the smaller of the two sizes, and return its new address.  Return 0
+ * if that fails, in which case the old chunk is untouched.  Chunks shrink in
+ * place, and grow in place when the block after them is free; only as a last
+ * resort is the data moved.  Mapped chunks are resized with mremap().  A null
+ * oldptr makes this the same as myalloc().
  */
+unsigned char *myrealloc(unsigned char *oldptr, size_t size) {
+    unsigned char *result;
+    size_t old_size;
+    int sampled;
 
-void init_myalloc() {
+    if (oldptr == 0) {
+        return myalloc(size);
+    }
     /*
-     * Allocate the entire memory pool, from which our simple allocator will
-     * serve allocation requests.
+     * A resized chunk is no longer the one that was sampled, but one that
+     * cannot be resized keeps its sample.
      */
-    mem = (unsigned char *) malloc(MEMORY_SIZE);
-    if (mem == 0) {
-        fprintf(stderr,
-                "init_myalloc: could not get %d bytes from the system\n",
-                MEMORY_SIZE);
-        abort();
+    sampled = __atomic_load_n(&profile_used, __ATOMIC_RELAXED)
+              && is_sampled(oldptr);
+    if (is_mapped(oldptr)) {
+        if (maps_own(size)) {
+            result = mapped_realloc(oldptr, size);
+            if (result == 0) {
+                diagnose("myrealloc: cannot service request of size %zu",
+                         size);
+            }
+            else if (sampled) {
+                /* The flag moved with the mapping; the sample did not. */
+                *((size_t *) result - 1) &= ~(size_t) SAMPLED;
+                forget_sample(oldptr);
+            }
+            return result;
+        }
+    }
+    else {
+        arena *a = arena_of(&default_pool, oldptr);
+        int resized;
+        lock_arena(a);
+        resized = heap_resize(a, oldptr, size);
+        unlock_arena(a);
+        if (resized) {
+            if (sampled) {
+                drop_sample(oldptr);
+            }
+            return oldptr;
+        }
+    }
+    /* Move the data to a new chunk; freeing the old one drops its sample. */
+    result = myalloc(size);
+    if (result != 0) {
+        old_size = usable_size(oldptr);
+        memcpy(result, oldptr, old_size < size ? old_size : size);
+        myfree(oldptr);
+    }
+    return result;
+}
+/*!
+ * Free a previously allocated pointer. oldptr should be an address returned by
+ * pool_alloc() for the same pool.  Deallocation is a constant time operation
+ * because the most time complex operations invoked are coalescing and
+ * free-list maintenance.  Coalescing requires constant time because it
+ * necessitates looking only at the blocks directly to the left and right of
+ * the just-freed block, and the doubly-linked free lists let either neighbour
+ * be unlinked directly.  In the thread-safe build, small blocks of the
+ * default pool are parked in the calling thread's cache instead, and blocks
+ * from another thread's arena are handed to that arena without taking its
+ * lock.  Mapped blocks are unmapped right away.
+ */
+void pool_free(pool_t *pool, unsigned char *oldptr) {
+    arena *a;
+    if (pool == &default_pool) {
+        unsample(oldptr);
+    }
+    if (pool == &default_pool && is_mapped(oldptr)) {
+        mapped_free(oldptr);
+        return;
+    }
+    /* The block goes back to whichever arena it came from. */
+    a = arena_of(pool, oldptr);
+#ifdef MYALLOC_THREADS
+    if (pool == &default_pool) {
+        if (a != home_arena(pool)) {
+            remote_free(a, oldptr);
+            return;
+        }
+        if (tcache_free(oldptr)) {
+            return;
+        }
+    }
+#endif
+    lock_arena(a);
+    heap_free(a, oldptr);
+    unlock_arena(a);
+}
+/*!
+ * Free a pointer previously returned by myalloc(), myalloc_aligned() or
+ * myrealloc(), back into the default pool.
+ */
+void myfree(unsigned char *oldptr) {
+    pool_free(&default_pool, oldptr);
+}
+
+/*!
+ * Return how many bytes a chunk of the default pool can hold, which is at
+ * least as many as were asked for.
+ */
+size_t myalloc_usable_size(unsigned char *ptr) {
+    return usable_size(ptr);
+}
+
+/*!
+ * Allocate "count" chunks of "size" bytes each from the default pool, storing
+ * them in out[], and return how many were allocated.  Whenever possible, they
+ * are carved back to back out of one free block, under a single lock and a
+ * single best-fit search; otherwise they are allocated one by one, stopping
+ * at the first that fails.  Each chunk is freed on its own, with myfree() or
+ * myfree_batch().
+ */
+int myalloc_batch(size_t size, int count, unsigned char **out) {
+    int done = 0;
+    if (count <= 0) {
+        return 0;
+    }
+    if (!maps_own(size)) {
+        arena *a = local_arena(&default_pool);
+        lock_arena(a);
+        drain_remote_frees(a);
+        if (heap_alloc_run(a, size, count, out)) {
+            done = count;
+        }
+        unlock_arena(a);
+    }
+    while (done < count && (out[done] = myalloc(size)) != 0) {
+        done++;
+    }
+    return done;
+}
+/* Orders chunk pointers by address, for qsort(). */
+static int compare_addresses(const void *x, const void *y) {
+    unsigned char *p = *(unsigned char * const *) x;
+    unsigned char *q = *(unsigned char * const *) y;
+    return p < q ? -1 : p > q;
+}
+/*!
+ * Free n chunks of the default pool at once; ptrs[] is sorted by address in
+ * the process.  Each arena is locked just once, and chunks whose blocks are
+ * neighbours in the heap are joined and coalesced as a single block, instead
+ * of once per chunk.  The thread cache is bypassed.
+ */
+void myfree_batch(unsigned char **ptrs, int n) {
+    int i = 0;
+
+    for (int j = 0; j < n; j++) {
+        unsample(ptrs[j]);
+    }
+    qsort(ptrs, n, sizeof(unsigned char *), compare_addresses);
+    while (i < n) {
+        arena *a;
+        if (is_mapped(ptrs[i])) {
+            mapped_free(ptrs[i]);
+            i++;
+            continue;
+        }
+        /* Being sorted, the chunks of one arena come one after another. */
+        a = arena_of(&default_pool, ptrs[i]);
+        lock_arena(a);
+        while (i < n && !is_mapped(ptrs[i])
+               && arena_of(&default_pool, ptrs[i]) == a) {
+            i = heap_free_run(a, ptrs, i, n);
+        }
+        unlock_arena(a);
+    }
+}
+
+/*!
+ * Returns the memory behind every whole free page of the pool to the system,
+ * for use when the program goes idle.  The calling thread's cache and any
+ * pending remote frees are flushed first, so that they can coalesce.  Returns
+ * 1 if any memory was released, and 0 otherwise.
+ */
+int myalloc_trim() {
+    long released = 0;
+#ifdef MYALLOC_THREADS
+    tcache_release(get_tcache());
+#endif
+    for (int i = 0; i < default_pool.num_arenas; i++) {
+        arena *a = &default_pool.arenas[i];
+        lock_arena(a);
+        drain_remote_frees(a);
+        quick_consolidate(a);
+        released += trim_tree(a, a->tree_root);
+        if (a->top != 0) {
+            released += trim_top(a, (unsigned char *) a->top,
+                                 (unsigned char *) a->top + *a->top);
+        }
+        unlock_arena(a);
     }
-    unsigned char *init = mem;
-    /* Set the header size of entire memory block. */
-    *((int *) init) = MEMORY_SIZE;
-    /* Move to the footer region. */
-    init = init + MEMORY_SIZE - sizeof(int);
-    /* Set the footer size of entire memory block. */
-    *((int *) init) = MEMORY_SIZE;
-    /* Move to the end of the entire memory. */
-    init = init + sizeof(int);
-    /* Set pointer to end for use in comparison later. */
-    end = (int *) init;
+    return released > 0;
+}
+
+static void lock_handles() {
+#ifdef MYALLOC_THREADS
+    pthread_mutex_lock(&handle_lock);
+#endif
+}
+static void unlock_handles() {
+#ifdef MYALLOC_THREADS
+    pthread_mutex_unlock(&handle_lock);
+#endif
 }
 /*
- * Takes an int pointer to a footer of a block memory and returns a pointer
- * to the block's header.
+ * Takes a handle off the free list, mapping another table of them if it is
+ * empty.  Returns 0 if that fails.
  */
-int * get_header(int *footer) {
-    int size;
-    size = abs(*footer);
-    footer = (int *) ((unsigned char *) footer - size + sizeof(int));
-    return footer;
+static myalloc_handle_t new_handle() {
+    myalloc_handle_t handle;
+    lock_handles();
+    if (free_handles == 0) {
+        handle_chunk *chunk = mmap(0, HANDLE_CHUNK_SIZE,
+                                   PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED) {
+            unlock_handles();
+            return 0;
+        }
+        chunk->next = handle_chunks;
+        handle_chunks = chunk;
+        for (size_t i = 0; i < HANDLES_PER_CHUNK; i++) {
+            chunk->handles[i].payload = (unsigned char *) free_handles;
+            free_handles = &chunk->handles[i];
+        }
+    }
+    handle = free_handles;
+    free_handles = (myalloc_handle_t) handle->payload;
+    unlock_handles();
+    return handle;
+}
+static void release_handle(myalloc_handle_t handle) {
+    lock_handles();
+    handle->payload = (unsigned char *) free_handles;
+    free_handles = handle;
+    unlock_handles();
 }
 /*
- * Returns an int pointer to the header of the smallest sized block of
- * memory which can satisfy allocation of a certain memory size. This operation
- * requires linear time with the number of memory blocks because it requires
- * looking at the size and state of allocation of each block in the entire
- * memory pool.
+ * Forgets every handle at once, along with the tables that hold them, when
+ * the chunks they name are gone.
  */
-int * best_fit_block(int size) {
-    int *result = 0;
-    /* Set a pointer to the beginning of the entire memory region. */
-    int *header = (int *) mem;
-    /* Exit the while loop when all headers have been looked through. */
-    while (header != 0) {
-        /* Check that size is sufficient and block is free. */
-        if ((abs(*header) >= size + 8) && (*header > 0)) {
-            /*
-             * If result is 0, any header should replace it; otherwise result
-             * should only be replaced if a smaller block is found.
-             */
-            if (!result || (abs(*header) < abs(*result))) {
-                result = header;
+void forget_handles() {
+    lock_handles();
+    while (handle_chunks != 0) {
+        handle_chunk *chunk = handle_chunks;
+        handle_chunks = chunk->next;
+        munmap(chunk, HANDLE_CHUNK_SIZE);
+    }
+    free_handles = 0;
+    compact_arena = 0;
+    unlock_handles();
+}
+/*!
+ * Allocate a movable chunk of "size" bytes from the default pool, and return
+ * a handle to it, or 0 if that fails.  The chunk is reached through
+ * handle_pin(), and may be moved by myalloc_compact() whenever it is not
+ * pinned.  It is always an ordinary block in the heap, never a slab slot or
+ * a chunk mapped on its own, however small or large it is, so that the
+ * compactor can move it; it costs HANDLE_PREFIX bytes more than a chunk from
+ * myalloc().
+ */
+myalloc_handle_t myalloc_handle(size_t size) {
+    myalloc_handle_t handle = new_handle();
+    unsigned char *payload = 0;
+
+    if (handle != 0 && size <= SIZE_MAX - HANDLE_PREFIX) {
+        arena *home = local_arena(&default_pool);
+        size += HANDLE_PREFIX;
+        for (int i = 0; i < default_pool.num_arenas && payload == 0; i++) {
+            int index = (home - default_pool.arenas + i)
+                        % default_pool.num_arenas;
+            arena *a = &default_pool.arenas[index];
+            lock_arena(a);
+            drain_remote_frees(a);
+            if (size <= arena_room(a)) {
+                payload = heap_alloc_block(a, block_needed(size));
+            }
+            /* The compactor must find the block whole once it is unlocked. */
+            if (payload != 0) {
+                *((size_t *) payload - 1) |= MOVABLE;
+                *(myalloc_handle_t *) payload = handle;
+                handle->payload = payload;
+                handle->pins = 0;
             }
+            unlock_arena(a);
         }
-        header = get_next_header(header);
+        size -= HANDLE_PREFIX;
     }
-    return result;
+    if (payload == 0) {
+        diagnose("myalloc_handle: cannot service request of size %zu", size);
+        if (handle != 0) {
+            release_handle(handle);
+        }
+        return 0;
+    }
+    return handle;
+}
+/*!
+ * Pin the chunk of a handle in place, and return its address, which stays
+ * valid until the matching handle_unpin().  Pins nest.  If the compactor is
+ * moving the chunk at that moment, this waits for it to finish.
+ */
+unsigned char *handle_pin(myalloc_handle_t handle) {
+    int pins = __atomic_load_n(&handle->pins, __ATOMIC_RELAXED);
+    for (;;) {
+        if (pins < 0) {
+            sched_yield();
+            pins = __atomic_load_n(&handle->pins, __ATOMIC_RELAXED);
+        }
+        else if (__atomic_compare_exchange_n(&handle->pins, &pins, pins + 1,
+                                             1, __ATOMIC_ACQUIRE,
+                                             __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    return handle->payload + HANDLE_PREFIX;
+}
+/*!
+ * Undo one handle_pin(); once every pin is undone, the compactor may move the
+ * chunk again, and addresses from handle_pin() must no longer be used.
+ */
+void handle_unpin(myalloc_handle_t handle) {
+    __atomic_sub_fetch(&handle->pins, 1, __ATOMIC_RELEASE);
+}
+/*!
+ * Free the chunk of a handle, which must not be pinned, and the handle with
+ * it.  A null handle is ignored.
+ */
+void myfree_handle(myalloc_handle_t handle) {
+    size_t *header;
+    arena *a;
+    if (handle == 0) {
+        return;
+    }
+    /* Pinning waits out a move, and keeps the compactor off the block. */
+    header = (size_t *) (handle_pin(handle) - HANDLE_PREFIX) - 1;
+    a = arena_of(&default_pool, (unsigned char *) header);
+    lock_arena(a);
+    a->frees++;
+    note_live(a, block_size(header), -1);
+    free_block(a, header);
+    unlock_arena(a);
+    release_handle(handle);
+}
+/*!
+ * Run the compactor for a slice of about "budget" bytes of work: every byte
+ * it moves counts, and so does each block it steps over, by a little.  It
+ * works through the arenas of the default pool in turn, picking up where the
+ * last slice stopped, and slides movable chunks that are not pinned down into
+ * the free space before them, so that free space gathers at the top of each
+ * heap and can be released.  Each arena is locked only while its part of a
+ * slice runs.  Return 1 while the current pass over the pool is unfinished,
+ * or 0 once it has reached the end of every arena.
+ */
+int myalloc_compact(size_t budget) {
+    long left = budget > LONG_MAX ? LONG_MAX : (long) budget;
+    int index = __atomic_load_n(&compact_arena, __ATOMIC_RELAXED);
+
+    while (left > 0) {
+        arena *a = &default_pool.arenas[index];
+        int finished;
+        lock_arena(a);
+        drain_remote_frees(a);
+        finished = compact_slice(a, &left);
+        unlock_arena(a);
+        if (finished && ++index == default_pool.num_arenas) {
+            __atomic_store_n(&compact_arena, 0, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    __atomic_store_n(&compact_arena, index, __ATOMIC_RELAXED);
+    return 1;
 }
+
 /*
- * Takes an int pointer to a header of a block memory and returns a pointer
- * to the block's footer.
+ * Returns the size of the largest free block of an arena: the top block, or
+ * the rightmost node of the tree, or else the largest block of the highest
+ * non-empty bin.
  */
-int * get_footer(int *header) {
-    int size;
-    size = abs(*header);
-    header = (int *) ((unsigned char *) header + size - sizeof(int));
-    return header;
+static size_t largest_free(arena *a) {
+    size_t *header = a->tree_root;
+    size_t largest = a->top != 0 ? *a->top : 0;
+    if (header != 0) {
+        while (get_node(header)->right != 0) {
+            header = get_node(header)->right;
+        }
+        return *header > largest ? *header : largest;
+    }
+    if (a->binmap == 0) {
+        return largest;
+    }
+    for (header = a->bins[31 - __builtin_clz(a->binmap)]; header != 0;
+         header = ((free_links *) (header + 1))->next) {
+        if (*header > largest) {
+            largest = *header;
+        }
+    }
+    return largest;
 }
 /*
- * Takes an int pointer to a header of a block memory and returns a pointer
- * to the next block's header. If there is no next block, 0 is returned.
+ * Returns the bytes an arena holds back for reuse in blocks that are not
+ * free: those on its quick lists, and the free slots of its partial slabs.
  */
-int * get_next_header(int *header) {
-    int size;
-    size = abs(*header);
-    header = (int *) ((unsigned char *) header + size);
-    /* Check if there is another header, or if end has been reached. */
-    if (header >= end) {
-        return 0x0;
+static size_t cached_bytes(arena *a) {
+    size_t cached = 0;
+    for (int i = 0; i < NUM_QUICK_LISTS; i++) {
+        cached += (size_t) a->quick_count[i] * i * ALIGNMENT;
     }
-    return header;
+    for (int i = 0; i < NUM_SLAB_CLASSES; i++) {
+        for (slab *page = a->partial_slabs[i]; page != 0; page = page->next) {
+            cached += (size_t) page->num_free * page->slot_size;
+        }
+    }
+    return cached;
 }
 /*!
- * Attempt to allocate a chunk of memory of "size" bytes.  Return 0 if
- * allocation fails. Allocation requires linear time because it necessitates
- * finding a best-fit block, which requires linear time (as described in the
- * comments above the best-fit function.)
+ * Fill in *stats with the counters of the default pool.  They are kept up to
+ * date as blocks are allocated, split, coalesced and freed, so this only
+ * adds them up across the arenas, and finds each arena's largest free block
+ * in its index, and by the NUMA node of each arena.  Counts in the
+ * thread-safe build leave out the chunks that the thread caches hand out and
+ * take back without visiting an arena.
  */
-unsigned char *myalloc(int size) {
-    int *header;
-    unsigned char *result;
-    /* Follow a best-fit strategy to find a memory block to allocate. */
-    header = best_fit_block(size);
+void myalloc_stats(myalloc_stats_t *stats) {
+    memset(stats, 0, sizeof(myalloc_stats_t));
+    stats->nodes = default_pool.num_nodes;
+    for (int i = 0; i < default_pool.num_nodes; i++) {
+        stats->node_id[i] = node_ids[i];
+    }
+    for (int i = 0; i < default_pool.num_arenas; i++) {
+        arena *a = &default_pool.arenas[i];
+        size_t largest;
+        size_t cached;
+        size_t in_use;
+        lock_arena(a);
+        largest = largest_free(a);
+        cached = cached_bytes(a);
+        in_use = (unsigned char *) a->end - (unsigned char *) a->start
+                 - a->free_bytes - cached;
+        stats->in_use += in_use;
+        stats->node_in_use[a->node] += in_use;
+        stats->node_committed[a->node] += a->committed - a->mem;
+        stats->cached += cached;
+        stats->free_bytes += a->free_bytes;
+        stats->free_blocks += a->free_blocks;
+        if (largest > stats->largest_free) {
+            stats->largest_free = largest;
+        }
+        /* The slab map and epilogue come out of the pool's memory too. */
+        stats->peak_footprint += (unsigned char *) a->high_water - a->mem
+                                 + sizeof(size_t);
+        stats->allocs += a->allocs;
+        stats->frees += a->frees;
+        stats->splits += a->splits;
+        stats->coalesces += a->coalesces;
+        stats->compacted += a->compacted;
+        if (a->page > (size_t) page_size) {
+            stats->huge_page_size = a->page;
+            stats->huge_committed += a->committed - a->mem;
+        }
+        unlock_arena(a);
+    }
+    stats->mapped = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+    stats->allocs += __atomic_load_n(&mapped_allocs, __ATOMIC_RELAXED);
+    stats->frees += __atomic_load_n(&mapped_frees, __ATOMIC_RELAXED);
+}
 
-    if (header == 0) {
-        fprintf(stderr, "myalloc: cannot service request of size %d\n", size);
+/*
+ * Returns the smallest span that init_arena() would lay out with as much heap
+ * as an arena's high-water mark reached.  The slab map ahead of the heap
+ * grows with the span, so the span is raised until it covers its own map.
+ */
+static size_t arena_required(arena *a) {
+    size_t used = (unsigned char *) a->high_water - (unsigned char *) a->start;
+    size_t span = 0;
+    size_t needed;
+
+    if (used == 0) {
         return 0;
     }
-    else {
+    needed = used + HEAP_PAD + sizeof(size_t);
+    while (span < needed + ((span / SLAB_SIZE + ALIGNMENT - 1)
+                            & ~(ALIGNMENT - 1))) {
+        span = needed + ((span / SLAB_SIZE + ALIGNMENT - 1)
+                         & ~(ALIGNMENT - 1));
+    }
+    return span;
+}
 
-        int *old_header;
-        old_header = header;
-        /* Only split if there is enough extra space for footers and headers. */
-        if (abs(*header) >= size + 4 * sizeof(int)) {
-
-            int orig_size = abs(*header);
-            /* Set allocated header size; negative since it is allocated. */
-            *header = (size + 2 * sizeof(int)) * -1;
-            header = get_footer(header);
-            /* Set allocated footer size; negative since it is allocated. */
-            *header = (size + 2 * sizeof(int)) * -1;
-            /* Move to the header in the second block after the split. */
-            header += 1;
-            /* Set header size. */
-            *header = orig_size - (size + 2 * sizeof(int));
-            header = get_footer(header);
-            /* Set footer size. */
-            *header = orig_size - (size + 2 * sizeof(int));
+/*!
+ * Return the smallest MEMORY_SIZE that would have served every request so far
+ * without the heap of any arena reaching past its end.  Placement never
+ * depends on how far the heap could grow, so a pool this small makes the
+ * same choices.  Every arena gets an equal share of the pool, so the pool has
+ * to give the busiest arena what it needed.  A smaller pool may still do, by
+ * serving small requests from ordinary blocks once there is no room for a
+ * new slab, or by spilling requests over from a full arena into the next,
+ * but only a search can find out how much smaller.  Chunks mapped on their
+ * own take memory too, though not from the pool, so the most that was ever
+ * mapped at once is added on; turning mapping off with
+ * myalloc_set_mmap_threshold() keeps every chunk in the pool being measured.
+ */
+size_t myalloc_required_memory() {
+    size_t span = 0;
+    for (int i = 0; i < default_pool.num_arenas; i++) {
+        arena *a = &default_pool.arenas[i];
+        size_t required;
+        lock_arena(a);
+        required = arena_required(a);
+        unlock_arena(a);
+        if (required > span) {
+            span = required;
         }
-        else {
-            /* If we don't split, just make header and footer negative. */
-            *header *= -1;
-            header = get_footer(header);
-            *header *= -1;
+    }
+    return ((span + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+           * default_pool.num_arenas
+           + __atomic_load_n(&mapped_peak, __ATOMIC_RELAXED);
+}
+
+/*!
+ * Walk every block of the default pool with get_next_header(), filling in
+ * *heap with a histogram of the free blocks by size and the resulting
+ * external fragmentation.  This takes time in proportion to the number of
+ * blocks, and holds each arena's lock while it walks that arena, so it is
+ * meant for occasional diagnostics rather than for every report.
+ */
+void myalloc_heap_walk(myalloc_heap_t *heap) {
+    memset(heap, 0, sizeof(myalloc_heap_t));
+    for (int i = 0; i < default_pool.num_arenas; i++) {
+        arena *a = &default_pool.arenas[i];
+        size_t *header;
+        lock_arena(a);
+        header = a->start < a->end ? a->start : 0;
+        for (; header != 0; header = get_next_header(a, header)) {
+            size_t size = block_size(header);
+            int index = 63 - __builtin_clzl(size);
+            heap->blocks++;
+            if (*header & BLOCK_ALLOCATED) {
+                continue;
+            }
+            heap->free_blocks++;
+            heap->free_bytes += size;
+            if (size > heap->largest_free) {
+                heap->largest_free = size;
+            }
+            if (index >= MYALLOC_HISTOGRAM_SIZE) {
+                index = MYALLOC_HISTOGRAM_SIZE - 1;
+            }
+            heap->histogram[index]++;
+        }
+        unlock_arena(a);
+    }
+    if (heap->free_bytes > 0) {
+        heap->fragmentation = 1.0 - (double) heap->largest_free
+                                    / heap->free_bytes;
+    }
+}
+
+/*!
+ * Set the handler consulted whenever a request cannot be served, or 0 to go
+ * back to reporting the failure.
+ */
+void myalloc_set_oom_handler(myalloc_oom_handler_t handler) {
+    __atomic_store_n(&oom_handler, handler, __ATOMIC_RELAXED);
+}
+
+/*!
+ * Map requests of at least "threshold" bytes on their own, outside the pool,
+ * or serve every request from the pool if it is 0.  Chunks already mapped
+ * are freed as usual, and keep being resized with mremap() while they stay
+ * above the threshold.
+ */
+void myalloc_set_mmap_threshold(size_t threshold) {
+    __atomic_store_n(&mmap_threshold, threshold, __ATOMIC_RELAXED);
+}
+
+/*!
+ * Choose how the next init_myalloc() backs the pool: one of the
+ * MYALLOC_HUGE_ modes.  The pool in use is not affected.
+ */
+void myalloc_set_huge_pages(int mode) {
+    huge_pages = mode;
+}
+
+/*!
+ * Send the allocator's diagnostics to "hook", or to standard error if it is
+ * 0, at most once every interval_ms milliseconds.
+ */
+void myalloc_set_diagnostic_hook(myalloc_diagnostic_hook_t hook,
+                                 long interval_ms) {
+    __atomic_store_n(&diagnostic_hook, hook, __ATOMIC_RELAXED);
+    __atomic_store_n(&diagnostic_interval, interval_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&last_diagnostic, -1, __ATOMIC_RELAXED);
+}
+
+/*!
+ * Start the heap profiler, sampling a myalloc() about every "period" bytes
+ * allocated, with an empty profile.  Threads that allocate at the time pick
+ * this up within PROFILE_RECHECK bytes.  Return 0 if the profile cannot be
+ * mapped.
+ */
+int myalloc_profile_start(size_t period) {
+    void *frames[1];
+    if (period == 0) {
+        return 0;
+    }
+    if (profile == 0) {
+        void *table = mmap(0, sizeof(profile_table), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (table == MAP_FAILED) {
+            return 0;
         }
-        result = (unsigned char *) old_header;
-        /* Return a pointer to the payload. */
-        return result + sizeof(int);
+        /* The first backtrace() may load the unwinder, which allocates. */
+        backtrace(frames, 1);
+        profile = table;
     }
+    lock_profile();
+    /* Giving the pages back is the quickest way to zero the profile. */
+    madvise(profile, sizeof(profile_table), MADV_DONTNEED);
+    profile->period = period;
+    unlock_profile();
+    __atomic_store_n(&profile_used, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&profile_period, period, __ATOMIC_RELAXED);
+    sample_countdown = sample_interval(period);
+    return 1;
+}
+
+/*!
+ * Stop taking samples.  The profile is kept, and samples are still dropped
+ * as their chunks are freed.
+ */
+void myalloc_profile_stop() {
+    __atomic_store_n(&profile_period, 0, __ATOMIC_RELAXED);
 }
 
 /*
- * When a block is freed, this coalesces it with the block to its left, which
- * has already been guaranteed to exist and be free.
- */
- int * back_coalesce(int * header) {
-     /* Size of the just freed block. */
-     int right = *header;
-     header -= 1;
-     /* Size of the block to the left. */
-     int left = *header;
-     /* Move to header of the coalesced block to set size. */
-     header = get_header(header);
-     *header += right;
-     /* Move to footer of the coalesced block to set size. */
-     header = get_footer(header);
-     *header += left;
-     /* Set pointer in correct position before backward coalescing. */
-     return get_header(header);
- }
- /*
-  * When a block is freed, this coalesces it with the block to its right, which
-  * has already been guaranteed to exist and be free.
-  */
- void fwd_coalesce(int * header) {
-     /* Size of the current block. */
-     int left = *header;
-     header = get_next_header(header);
-     /* Size of the block to the right. */
-     int right = *header;
-     header -= 1;
-     /* Move to the header of the coalesced block and set size. */
-     header = get_header(header);
-     *header += right;
-     /* Move to the footer of the coalesced block and set size. */
-     header = get_footer(header);
-     *header += left;
- }
- /*!
-  * Free a previously allocated pointer. oldptr should be an address returned by
-  * myalloc().  Deallocation is a constant time operation because the most time
-  * complex operation invoked is coalescing. Coalescing requires constant time
-  * because it necessitates looking only at the blocks directly to the left and
-  * right of the just-freed block.
-  */
- void myfree(unsigned char *oldptr) {
-
-    int *newptr;
-    /* Designate header of block as freed. */
-    newptr = (int *) oldptr - 1;
-    *newptr *= -1;
-    /* Designate footer of block as freed. */
-    newptr = get_footer(newptr);
-    *newptr *= -1;
-    /* Set-up pointer for coalescing. */
-    newptr = get_header(newptr);
-    /* Check that there is a block to the left and it is free. */
-    if (newptr != (int *) mem) {
-        if (*(newptr - 1) > 0) {
-            newptr = back_coalesce(newptr);
-        }
-    }
-    /* Set-up pointer for coalescing. */
-    newptr = get_next_header(newptr);
-    /* Check that there is a block to the right and it is free. */
-    if (newptr != 0) {
-        if (*newptr > 0) {
-            /* Move back to header to prepare for coalescing. */
-            newptr -= 1;
-            newptr = get_header(newptr);
-            fwd_coalesce(newptr);
+ * Output for the profile dumps, gathered in a buffer and handed to write()
+ * in large pieces, without going through stdio.
+ */
+typedef struct dump_buffer {
+    int fd;
+    int failed;
+    size_t used;
+    char data[4096];
+} dump_buffer;
+
+static void dump_flush(dump_buffer *out) {
+    size_t done = 0;
+    while (done < out->used && !out->failed) {
+        ssize_t written = write(out->fd, out->data + done, out->used - done);
+        if (written <= 0) {
+            out->failed = 1;
+        }
+        else {
+            done += written;
+        }
+    }
+    out->used = 0;
+}
+static void dump_printf(dump_buffer *out, const char *format, ...) {
+    va_list args;
+    int length;
+    if (out->used + DIAGNOSTIC_LENGTH > sizeof(out->data)) {
+        dump_flush(out);
+    }
+    va_start(args, format);
+    length = vsnprintf(out->data + out->used, sizeof(out->data) - out->used,
+                       format, args);
+    va_end(args);
+    if (length > 0) {
+        out->used += (size_t) length < sizeof(out->data) - out->used
+                     ? (size_t) length : sizeof(out->data) - out->used - 1;
+    }
+}
+static void dump_frames(dump_buffer *out, void **frames, int depth) {
+    dump_printf(out, " @");
+    for (int i = 0; i < depth; i++) {
+        dump_printf(out, " %p", frames[i]);
+    }
+    dump_printf(out, "\n");
+}
+
+/*!
+ * Write the heap profile to "fd" in the heap profile format of gperftools,
+ * which pprof reads: for every sampled stack, the number and bytes of its
+ * live samples, followed in brackets by those of all of its samples since
+ * the profiler was started, and then the process's memory map, which pprof
+ * needs to symbolize the addresses.  "pprof --inuse_space" and "pprof
+ * --alloc_space" show the live and cumulative profiles.  Return 0 if the
+ * profiler was never started or writing fails.
+ */
+int myalloc_profile_dump(int fd) {
+    dump_buffer out = {fd, 0, 0, {0}};
+    size_t totals[4] = {0, 0, 0, 0};
+    char maps[4096];
+    int maps_fd;
+    ssize_t length;
+
+    if (profile == 0) {
+        return 0;
+    }
+    lock_profile();
+    for (int i = 0; i < profile->num_stacks; i++) {
+        totals[0] += profile->stacks[i].live_count;
+        totals[1] += profile->stacks[i].live_bytes;
+        totals[2] += profile->stacks[i].total_count;
+        totals[3] += profile->stacks[i].total_bytes;
+    }
+    dump_printf(&out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                totals[0], totals[1], totals[2], totals[3], profile->period);
+    for (int i = 0; i < profile->num_stacks; i++) {
+        profile_stack *stack = &profile->stacks[i];
+        dump_printf(&out, "%zu: %zu [%zu: %zu]", stack->live_count,
+                    stack->live_bytes, stack->total_count, stack->total_bytes);
+        dump_frames(&out, stack->frames, stack->depth);
+    }
+    unlock_profile();
+    dump_printf(&out, "\nMAPPED_LIBRARIES:\n");
+    dump_flush(&out);
+    maps_fd = open("/proc/self/maps", O_RDONLY);
+    if (maps_fd >= 0) {
+        while ((length = read(maps_fd, maps, sizeof(maps))) > 0) {
+            memcpy(out.data, maps, length);
+            out.used = length;
+            dump_flush(&out);
         }
+        close(maps_fd);
     }
+    return !out.failed;
+}
+
+/*!
+ * Write every live sample to "fd", one per line: its size, how many
+ * milliseconds ago it was taken, and its stack.  Return 0 if the profiler
+ * was never started or writing fails.
+ */
+int myalloc_profile_samples(int fd) {
+    dump_buffer out = {fd, 0, 0, {0}};
+    long now = now_ms();
+
+    if (profile == 0) {
+        return 0;
+    }
+    lock_profile();
+    for (int bucket = 0; bucket < PROFILE_MAX_SAMPLES; bucket++) {
+        for (int index = profile->sample_heads[bucket]; index != 0;
+             index = profile->samples[index - 1].next) {
+            profile_sample *sample = &profile->samples[index - 1];
+            profile_stack *stack = &profile->stacks[sample->stack - 1];
+            dump_printf(&out, "%zu bytes, %ld ms old", sample->size,
+                        now - sample->time);
+            dump_frames(&out, stack->frames, stack->depth);
+        }
+    }
+    if (profile->dropped > 0) {
+        dump_printf(&out, "%lu samples dropped\n", profile->dropped);
+    }
+    unlock_profile();
+    dump_flush(&out);
+    return !out.failed;
 }
 
 /*!
  * Clean up the allocator state.
- * All this really has to do is free the user memory pool. This function mostly
+ * All this really has to do is unmap the user memory pool. This function mostly
  * ensures that the test program doesn't leak memory, so it's easy to check
  * if the allocator does.
  */
 void close_myalloc() {
-    free(mem);
+#ifdef MYALLOC_THREADS
+    for (int i = 0; i < default_pool.num_arenas; i++) {
+        pthread_mutex_destroy(&default_pool.arenas[i].lock);
+    }
+#endif
+    munmap(default_pool.mem, default_pool.size);
+}
+
+/*!
+ * Create a pool with room for about "size" bytes of chunks, in a reservation
+ * of its own that also holds the pool's descriptor.  Like the default pool,
+ * it only commits memory as its heap grows.  Return 0 if the address space
+ * cannot be reserved.
+ */
+pool_t * pool_create(size_t size) {
+    unsigned char *base;
+    size_t header;
+
+    if (page_size == 0) {
+        init_constants();
+    }
+    header = (sizeof(pool_t) + page_size - 1) & ~(page_size - 1);
+    base = MAP_FAILED;
+    if (size <= SIZE_MAX - header) {
+        base = mmap(0, header + size, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (base != MAP_FAILED && mprotect(base, header,
+                                       PROT_READ | PROT_WRITE) != 0) {
+        munmap(base, header + size);
+        base = MAP_FAILED;
+    }
+    if (base == MAP_FAILED) {
+        diagnose("pool_create: could not reserve %zu bytes from the system",
+                 size);
+        return 0;
+    }
+    init_pool((pool_t *) base, base + header, size, 1, page_size, 1);
+    return (pool_t *) base;
+}
+
+/*!
+ * Free every chunk of a pool at once, without visiting any of them: each
+ * arena's heap is cut back to one free block over the memory it has already
+ * committed, which stays committed for reuse.  In the thread-safe build,
+ * resetting the default pool also discards what the threads have cached.
+ * Every handle of the default pool is released too, since its chunk is gone.
+ * Chunks the default pool mapped on their own are not affected.  No other
+ * thread may use the pool meanwhile.
+ */
+void pool_reset(pool_t *pool) {
+    if (pool == &default_pool) {
+#ifdef MYALLOC_THREADS
+        pool_generation++;
+#endif
+        forget_samples();
+        forget_handles();
+    }
+    for (int i = 0; i < pool->num_arenas; i++) {
+        lock_arena(&pool->arenas[i]);
+        reset_arena(&pool->arenas[i]);
+        unlock_arena(&pool->arenas[i]);
+    }
+}
+
+/*!
+ * Release a pool made by pool_create(), along with every chunk still
+ * allocated from it.
+ */
+void pool_destroy(pool_t *pool) {
+#ifdef MYALLOC_THREADS
+    for (int i = 0; i < pool->num_arenas; i++) {
+        pthread_mutex_destroy(&pool->arenas[i].lock);
+    }
+#endif
+    munmap(pool, pool->mem - (unsigned char *) pool + pool->size);
 }
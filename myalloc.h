@@ -8,22 +8,276 @@
  * All rights reserved.
  */
 
+#include <stddef.h>
 
-/*! Specifies the size of the memory pool the allocator has to work with. */
-extern int MEMORY_SIZE;
+
+/*!
+ * Specifies the size of the memory pool the allocator has to work with.  This
+ * much address space is reserved, but memory is only committed as it is used.
+ */
+extern size_t MEMORY_SIZE;
 
 
 /* Initializes allocator state, and memory pool state too. */
 void init_myalloc();
 
 
+/*!
+ * How init_myalloc() backs the memory pool: with ordinary pages, with
+ * transparent huge pages, or with huge pages the system has set aside
+ * (MAP_HUGETLB), which are reserved for the whole pool up front.  Whatever
+ * the system cannot provide falls back to the mode before it.
+ */
+#define MYALLOC_HUGE_NONE 0
+#define MYALLOC_HUGE_TRANSPARENT 1
+#define MYALLOC_HUGE_TLB 2
+
+
+/* Choose how the next init_myalloc() backs the pool. */
+void myalloc_set_huge_pages(int mode);
+
+
+/*
+ * Map requests of at least "threshold" bytes outside the pool, or none at
+ * all if it is 0.
+ */
+void myalloc_set_mmap_threshold(size_t threshold);
+
+
 /* Attempt to allocate a chunk of memory of "size" bytes. */
-unsigned char * myalloc(int size);
+unsigned char * myalloc(size_t size);
+
+
+/*
+ * Attempt to allocate a chunk of "size" bytes at a multiple of "alignment",
+ * which must be a power of two.
+ */
+unsigned char * myalloc_aligned(size_t size, size_t alignment);
+
+
+/*
+ * Attempt to allocate "count" zeroed objects of "size" bytes each, clearing
+ * only the memory that may not be zero already.
+ */
+unsigned char * mycalloc(size_t count, size_t size);
+
+
+/* Resize a previously allocated chunk, moving it only if necessary. */
+unsigned char * myrealloc(unsigned char *oldptr, size_t size);
 
 
 /* Free a previously allocated pointer. */
 void myfree(unsigned char *oldptr);
 
 
+/*
+ * Attempt to allocate "count" chunks of "size" bytes each into out[], and
+ * return how many were allocated.
+ */
+int myalloc_batch(size_t size, int count, unsigned char **out);
+
+
+/* Free n previously allocated pointers at once, sorting the array. */
+void myfree_batch(unsigned char **ptrs, int n);
+
+
+/* Return how many bytes a chunk can hold, at least the size it was given. */
+size_t myalloc_usable_size(unsigned char *ptr);
+
+
+/* Return the unused pages of the memory pool to the system. */
+int myalloc_trim();
+
+
+/*!
+ * A handle to a movable chunk of the default pool.  The chunk's address is
+ * only known while it is pinned; the rest of the time, myalloc_compact() may
+ * move it to close up the free space before it.  Every handle is released by
+ * init_myalloc() and by resetting the default pool.
+ */
+typedef struct myalloc_handle *myalloc_handle_t;
+
+
+/* Attempt to allocate a movable chunk of "size" bytes; return 0 on failure. */
+myalloc_handle_t myalloc_handle(size_t size);
+
+
+/* Return the address of a handle's chunk, which stays put until unpinned. */
+unsigned char *handle_pin(myalloc_handle_t handle);
+void handle_unpin(myalloc_handle_t handle);
+
+
+/* Free a handle and its chunk, which must not be pinned. */
+void myfree_handle(myalloc_handle_t handle);
+
+
+/*
+ * Move unpinned chunks toward the start of the heap for about "budget" bytes
+ * of work; return 1 while the pass over the pool is unfinished.
+ */
+int myalloc_compact(size_t budget);
+
+
+/* The most NUMA nodes the default pool spreads its arenas over. */
+#define MYALLOC_MAX_NODES 8
+
+
+/*!
+ * Counters describing the default pool, as reported by myalloc_stats().
+ * Sizes are in bytes and include block headers.  Chunks parked in the
+ * quick lists or in spare slab slots count as cached rather than in use; in
+ * the thread-safe build, chunks in the threads' own caches count as in use.
+ */
+typedef struct myalloc_stats {
+    size_t in_use;          /* held by allocated chunks */
+    size_t cached;          /* held in the quick lists and spare slab slots */
+    size_t free_bytes;      /* in free blocks */
+    size_t free_blocks;
+    size_t largest_free;    /* the largest free block */
+    size_t mapped;          /* in chunks mapped on their own */
+    size_t peak_footprint;  /* the most of the pool's memory ever in use */
+    size_t huge_page_size;  /* of the pool's huge pages, or 0 if it has none */
+    size_t huge_committed;  /* of the pool's memory, in huge pages */
+    int nodes;              /* NUMA nodes the arenas are spread over */
+    int node_id[MYALLOC_MAX_NODES];            /* system number, by node */
+    size_t node_in_use[MYALLOC_MAX_NODES];     /* in_use, by node */
+    size_t node_committed[MYALLOC_MAX_NODES];  /* pool memory, by node */
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long splits;     /* free blocks split to serve a request */
+    unsigned long coalesces;  /* free blocks merged with a neighbour */
+    size_t compacted;         /* bytes moved by myalloc_compact() */
+} myalloc_stats_t;
+
+
+/* Fill in the counters of the default pool, without walking the heap. */
+void myalloc_stats(myalloc_stats_t *stats);
+
+
+/*
+ * Return the smallest MEMORY_SIZE whose pool would have reached as high as
+ * every request since init_myalloc() has, which one run against a generous
+ * pool can measure, since the heap only grows on demand.
+ */
+size_t myalloc_required_memory();
+
+
+/* Number of power-of-two size classes in a myalloc_heap_t histogram. */
+#define MYALLOC_HISTOGRAM_SIZE 48
+
+
+/*!
+ * What a walk over every block of the default pool found.  histogram[i]
+ * counts the free blocks of at least 2^i and less than 2^(i+1) bytes, with
+ * the last class taking everything larger.  fragmentation is the share of
+ * free memory outside the largest free block: 0 when all of it is in one
+ * block, approaching 1 as it is scattered over many small ones.
+ */
+typedef struct myalloc_heap {
+    size_t blocks;
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t largest_free;
+    size_t histogram[MYALLOC_HISTOGRAM_SIZE];
+    double fragmentation;
+} myalloc_heap_t;
+
+
+/* Walk the heap of the default pool, taking each arena's lock in turn. */
+void myalloc_heap_walk(myalloc_heap_t *heap);
+
+
+/*!
+ * Start the heap profiler, which samples a myalloc() about every "period"
+ * bytes, recording its stack, size and time until it is freed.  Small
+ * sampled chunks take a few hundred bytes.  Return 0 if that fails.
+ */
+int myalloc_profile_start(size_t period);
+
+
+/* Stop sampling, keeping the profile. */
+void myalloc_profile_stop();
+
+
+/*
+ * Write the live and cumulative heap profiles to a file descriptor, in a
+ * format pprof reads.  Return 0 if that fails.
+ */
+int myalloc_profile_dump(int fd);
+
+
+/* Write every live sample, with its age, to a file descriptor. */
+int myalloc_profile_samples(int fd);
+
+
 /* Clean up the allocator and memory pool state. */
 void close_myalloc();
+
+
+/*!
+ * What an out-of-memory handler asks the allocator to do about a request
+ * that cannot be served: try again, after the handler has released memory
+ * (by flushing caches of its own, say); serve it by growing the pool past its
+ * reservation, with a mapping of its own; or fail without any diagnostic.
+ * Chunks of pools from pool_create() cannot grow that way, and fail instead.
+ */
+#define MYALLOC_OOM_FAIL 0
+#define MYALLOC_OOM_RETRY 1
+#define MYALLOC_OOM_GROW 2
+
+
+/*!
+ * An out-of-memory handler is called with the size of the failed request and
+ * the number of times it has been consulted about it, starting at 1, and
+ * returns one of the MYALLOC_OOM_ actions.  It is called without any of the
+ * allocator's locks held, so it may free memory and call myalloc_trim().
+ */
+typedef int (*myalloc_oom_handler_t)(size_t size, int attempt);
+
+
+/* Install an out-of-memory handler, or remove it with 0. */
+void myalloc_set_oom_handler(myalloc_oom_handler_t handler);
+
+
+/*!
+ * A diagnostic hook receives one line of text, without a newline, about a
+ * failure the allocator could not otherwise report, such as a failed request
+ * when no out-of-memory handler is installed.
+ */
+typedef void (*myalloc_diagnostic_hook_t)(const char *message);
+
+
+/*
+ * Pass diagnostics to "hook", or to standard error if it is 0, at most once
+ * every interval_ms milliseconds; those in between are counted instead.
+ */
+void myalloc_set_diagnostic_hook(myalloc_diagnostic_hook_t hook,
+                                 long interval_ms);
+
+
+/*
+ * An independent memory pool with a reservation of its own, whose chunks can
+ * all be thrown away at once.  The functions above work against a default
+ * pool of MEMORY_SIZE bytes.
+ */
+typedef struct pool pool_t;
+
+
+/* Create a pool that can hand out up to about "size" bytes. */
+pool_t * pool_create(size_t size);
+
+
+/* Attempt to allocate a chunk of memory of "size" bytes from a pool. */
+unsigned char * pool_alloc(pool_t *pool, size_t size);
+
+
+/* Free a pointer previously allocated from the same pool. */
+void pool_free(pool_t *pool, unsigned char *oldptr);
+
+
+/* Free every chunk of a pool at once, leaving the pool empty. */
+void pool_reset(pool_t *pool);
+
+
+/* Release a pool and all of its memory. */
+void pool_destroy(pool_t *pool);
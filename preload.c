@@ -0,0 +1,451 @@
+/*! \file
+ * A drop-in replacement for the standard allocation functions, built on the
+ * thread-safe allocator as libmyalloc.so ("make libmyalloc.so"), so that
+ * unmodified programs can be run on it:
+ *
+ *   LD_PRELOAD=./libmyalloc.so program ...
+ *
+ * The pool is set up by the first call that needs it, rather than by
+ * init_myalloc().  It reserves MYALLOC_MEMORY_SIZE bytes of address space,
+ * DEFAULT_MEMORY_SIZE if that is not set, and requests it cannot hold are
+ * mapped on their own instead of failing.  MYALLOC_HUGE_PAGES may pick one of
+ * the MYALLOC_HUGE_ modes for backing the pool by number (see myalloc.h).
+ * The allocator keeps the pool consistent across fork().
+ *
+ * If MYALLOC_TRACE names a file, every allocation, reallocation and free is
+ * also written there as a trace (see trace.h), which "testmyalloc -r" can
+ * replay.  Only the process that started the trace writes to it; children
+ * it forks are not traced.  An existing file is never overwritten: a process
+ * that finds one, such as a program the traced one runs, which inherits
+ * MYALLOC_TRACE, writes to the same name with ".<pid>" added instead.  The
+ * trace records the sizes asked for and not what they were aligned to.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "myalloc.h"
+#include "trace.h"
+
+#define DEFAULT_MEMORY_SIZE ((size_t) 16 << 30)
+#define TRACE_BUFFER_SIZE (64 * 1024)
+#define MIN_OBJECT_TABLE 4096
+
+
+// 0 before the pool is set up, 1 while one thread sets it up, 2 after
+static int state;
+// set in the thread setting up the pool, which may allocate while it does
+static __thread int initializing;
+
+
+// The trace, if there is one.  A table from the address of each live chunk
+// to its object number and size, mapped directly since malloc() cannot be
+// used here, gives frees and reallocations their object.
+typedef struct traced_object {
+  uintptr_t address;   // 0 for an empty slot
+  uint64_t id;
+  size_t size;
+} TRACED_OBJECT;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;
+static TRACE_HEADER trace_header;
+static unsigned char trace_buffer[TRACE_BUFFER_SIZE];
+static size_t trace_buffered;
+static int64_t trace_prev_id;
+static int64_t trace_prev_size;
+static uint64_t trace_live;
+static TRACED_OBJECT *objects;
+static size_t object_slots;   // a power of two
+static size_t object_count;
+
+
+static void trace_flush() {
+  size_t done = 0;
+  while (done < trace_buffered) {
+    ssize_t written = write(trace_fd, trace_buffer + done,
+                            trace_buffered - done);
+    if (written <= 0)
+      break;
+    done += written;
+  }
+  trace_buffered = 0;
+}
+
+static size_t object_slot(uintptr_t address) {
+  // a multiplicative hash of the address, less its always-zero low bits
+  return ((address >> 4) * 0x9e3779b97f4a7c15ULL) & (object_slots - 1);
+}
+
+// Finds the slot holding address, or the empty slot where it would go.
+static TRACED_OBJECT *find_object(uintptr_t address) {
+  size_t i = object_slot(address);
+  while (objects[i].address != 0 && objects[i].address != address)
+    i = (i + 1) & (object_slots - 1);
+  return &objects[i];
+}
+
+// Empties a slot, moving later entries of its run back so that every entry
+// can still be found from its own slot.
+static void remove_object(TRACED_OBJECT *object) {
+  size_t hole = object - objects;
+  size_t i = hole;
+
+  objects[hole].address = 0;
+  for (;;) {
+    size_t home;
+    i = (i + 1) & (object_slots - 1);
+    if (objects[i].address == 0)
+      return;
+    home = object_slot(objects[i].address);
+    // leave the entry if its home lies cyclically after the hole
+    if ((i > hole && (home <= hole || home > i))
+        || (i < hole && home <= hole && home > i)) {
+      objects[hole] = objects[i];
+      objects[i].address = 0;
+      hole = i;
+    }
+  }
+}
+
+// Doubles the table when it is half full; returns 0 if that fails.
+static int grow_objects() {
+  TRACED_OBJECT *old = objects;
+  size_t old_slots = object_slots;
+  size_t slots = old_slots ? 2 * old_slots : MIN_OBJECT_TABLE;
+  void *table;
+
+  if (object_count < old_slots / 2)
+    return 1;
+  table = mmap(0, slots * sizeof(TRACED_OBJECT), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (table == MAP_FAILED)
+    return 0;
+  objects = (TRACED_OBJECT *) table;
+  object_slots = slots;
+  for (size_t i = 0; i < old_slots; i++) {
+    if (old[i].address != 0)
+      *find_object(old[i].address) = old[i];
+  }
+  if (old != NULL)
+    munmap(old, old_slots * sizeof(TRACED_OBJECT));
+  return 1;
+}
+
+// Appends one record, under trace_lock.
+static void trace_append(int op, TRACED_OBJECT *object) {
+  int64_t id = object->id;
+
+  if (trace_buffered + TRACE_RECORD_MAX > TRACE_BUFFER_SIZE)
+    trace_flush();
+  trace_buffered += trace_record(trace_buffer + trace_buffered, op,
+                                 id - trace_prev_id,
+                                 (int64_t) object->size - trace_prev_size);
+  trace_prev_id = id;
+  if (op != TRACE_FREE)
+    trace_prev_size = object->size;
+  trace_header.ops++;
+}
+
+// Records a new chunk, or a reallocated one if old is not 0.
+static void trace_alloc(unsigned char *old, unsigned char *ptr, size_t size) {
+  TRACED_OBJECT *object;
+  TRACED_OBJECT moved;
+  int op = TRACE_ALLOC;
+
+  if (old != 0) {
+    object = find_object((uintptr_t) old);
+    if (object->address != 0) {
+      moved = *object;
+      remove_object(object);
+      trace_live -= moved.size;
+      object_count--;
+      op = TRACE_REALLOC;
+    }
+  }
+  if (!grow_objects()) {
+    return;
+  }
+  object = find_object((uintptr_t) ptr);
+  if (op == TRACE_REALLOC) {
+    object->id = moved.id;
+  }
+  else {
+    object->id = trace_header.objects++;
+  }
+  object->address = (uintptr_t) ptr;
+  object->size = size;
+  object_count++;
+  trace_live += size;
+  trace_header.total_bytes += size;
+  if (trace_live > trace_header.peak_bytes)
+    trace_header.peak_bytes = trace_live;
+  trace_append(op, object);
+}
+
+static void trace_free(unsigned char *ptr) {
+  TRACED_OBJECT *object = find_object((uintptr_t) ptr);
+  if (object->address == 0)
+    return;
+  trace_append(TRACE_FREE, object);
+  trace_live -= object->size;
+  object_count--;
+  remove_object(object);
+}
+
+// Writes out what is buffered and the final header when the program exits.
+static void __attribute__((destructor)) trace_finish() {
+  if (trace_fd < 0)
+    return;
+  pthread_mutex_lock(&trace_lock);
+  trace_flush();
+  if (pwrite(trace_fd, &trace_header, sizeof(trace_header), 0)
+      != sizeof(trace_header))
+    trace_header.ops = 0;
+  close(trace_fd);
+  trace_fd = -1;
+  pthread_mutex_unlock(&trace_lock);
+}
+
+// A child stops tracing, leaving the file to its parent.
+static void trace_fork_child() {
+  pthread_mutex_init(&trace_lock, 0);
+  if (trace_fd >= 0)
+    close(trace_fd);
+  trace_fd = -1;
+}
+
+// Creates a trace file, which must not exist yet, or returns -1.
+static int trace_create(const char *path) {
+  return open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+}
+
+// Creates the trace at path, or at path.<pid> if path is taken.  The name is
+// put together by hand, since snprintf() may allocate.
+static int trace_open_file(const char *path) {
+  char name[PATH_MAX];
+  char digits[24];
+  size_t length = strlen(path);
+  int count = 0;
+  int fd = trace_create(path);
+
+  if (fd >= 0 || errno != EEXIST)
+    return fd;
+  for (unsigned long pid = getpid(); pid != 0 || count == 0; pid /= 10)
+    digits[count++] = (char) ('0' + pid % 10);
+  if (length + 1 + count >= sizeof(name))
+    return -1;
+  memcpy(name, path, length);
+  name[length++] = '.';
+  while (count > 0)
+    name[length++] = digits[--count];
+  name[length] = '\0';
+  return trace_create(name);
+}
+
+static void trace_start(const char *path) {
+  trace_fd = trace_open_file(path);
+  if (trace_fd < 0)
+    return;
+  memcpy(trace_header.magic, TRACE_MAGIC, sizeof(trace_header.magic));
+  if (write(trace_fd, &trace_header, sizeof(trace_header))
+      != sizeof(trace_header) || !grow_objects()) {
+    close(trace_fd);
+    trace_fd = -1;
+    return;
+  }
+  pthread_atfork(NULL, NULL, trace_fork_child);
+}
+
+
+// Rather than fail, requests the pool cannot hold are mapped on their own.
+static int map_instead(size_t size, int attempt) {
+  return MYALLOC_OOM_GROW;
+}
+
+static void setup() {
+  char *size = getenv("MYALLOC_MEMORY_SIZE");
+  char *huge = getenv("MYALLOC_HUGE_PAGES");
+  char *trace = getenv("MYALLOC_TRACE");
+
+  MEMORY_SIZE = size != NULL ? strtoull(size, NULL, 0) : DEFAULT_MEMORY_SIZE;
+  if (MEMORY_SIZE == 0)
+    MEMORY_SIZE = DEFAULT_MEMORY_SIZE;
+  if (huge != NULL)
+    myalloc_set_huge_pages(atoi(huge));
+  init_myalloc();
+  myalloc_set_oom_handler(map_instead);
+  if (trace != NULL && *trace != '\0')
+    trace_start(trace);
+}
+
+// Sets the pool up on first use; threads that lose the race wait for it.
+static inline void ensure_ready() {
+  int expected = 0;
+  if (__builtin_expect(__atomic_load_n(&state, __ATOMIC_ACQUIRE) == 2, 1)
+      || initializing)
+    return;
+  if (__atomic_compare_exchange_n(&state, &expected, 1, 0, __ATOMIC_ACQ_REL,
+                                  __ATOMIC_ACQUIRE)) {
+    initializing = 1;
+    setup();
+    initializing = 0;
+    __atomic_store_n(&state, 2, __ATOMIC_RELEASE);
+  }
+  else {
+    while (__atomic_load_n(&state, __ATOMIC_ACQUIRE) != 2)
+      sched_yield();
+  }
+}
+
+static inline int tracing() {
+  return __builtin_expect(trace_fd >= 0, 0);
+}
+
+
+// Finishes an allocation of "size" bytes, logging it if it succeeded.
+static void *allocated(unsigned char *result, size_t size) {
+  if (result == 0) {
+    errno = ENOMEM;
+  }
+  else if (tracing()) {
+    pthread_mutex_lock(&trace_lock);
+    trace_alloc(0, result, size);
+    pthread_mutex_unlock(&trace_lock);
+  }
+  return result;
+}
+
+
+void *malloc(size_t size) {
+  ensure_ready();
+  return allocated(myalloc(size), size);
+}
+
+void free(void *ptr) {
+  if (ptr == NULL)
+    return;
+  // logged first, so no other thread can be given the chunk until it is
+  if (tracing()) {
+    pthread_mutex_lock(&trace_lock);
+    trace_free(ptr);
+    pthread_mutex_unlock(&trace_lock);
+  }
+  myfree(ptr);
+}
+
+// Only what may not be zero already is cleared; see mycalloc().
+void *calloc(size_t count, size_t size) {
+  size_t total;
+
+  // checked here too, since mycalloc() would report it
+  if (__builtin_mul_overflow(count, size, &total)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  ensure_ready();
+  return allocated(mycalloc(count, size), total);
+}
+
+void *realloc(void *ptr, size_t size) {
+  unsigned char *result;
+
+  if (ptr == NULL)
+    return malloc(size);
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+  if (!tracing()) {
+    result = myrealloc(ptr, size);
+  }
+  else {
+    // held throughout, since the old chunk may be handed out again as soon
+    // as it is freed, and must not be until the move is logged
+    pthread_mutex_lock(&trace_lock);
+    result = myrealloc(ptr, size);
+    if (result != 0)
+      trace_alloc(ptr, result, size);
+    pthread_mutex_unlock(&trace_lock);
+  }
+  if (result == 0)
+    errno = ENOMEM;
+  return result;
+}
+
+void *reallocarray(void *ptr, size_t count, size_t size) {
+  size_t total;
+
+  if (__builtin_mul_overflow(count, size, &total)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return realloc(ptr, total);
+}
+
+// Allocates with an alignment that is already known to be a power of two.
+static void *aligned(size_t alignment, size_t size) {
+  ensure_ready();
+  return allocated(myalloc_aligned(size, alignment), size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+  void *result;
+
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0
+      || alignment % sizeof(void *) != 0)
+    return EINVAL;
+  result = aligned(alignment, size);
+  if (result == NULL)
+    return ENOMEM;
+  *out = result;
+  return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return aligned(alignment, size);
+}
+
+// As in glibc, small alignments need nothing more than malloc(), and any
+// other alignment is rounded up to a power of two.
+void *memalign(size_t alignment, size_t size) {
+  size_t power = 2 * sizeof(void *);
+  if (alignment <= power)
+    return malloc(size);
+  while (power < alignment) {
+    if (power > SIZE_MAX / 2) {
+      errno = EINVAL;
+      return NULL;
+    }
+    power *= 2;
+  }
+  return aligned(power, size);
+}
+
+void *valloc(size_t size) {
+  return aligned(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  return aligned(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr) {
+  if (ptr == NULL)
+    return 0;
+  return myalloc_usable_size(ptr);
+}
@@ -23,6 +23,7 @@ SEQLIST *seq_add_front(int size, unsigned char *ref_block, SEQLIST *next) {
   result->alloc = 1;
   result->freed = 0;
   result->size = size;
+  result->id = 0;
   result->ref_block = ref_block;
   result->myalloc_block = (unsigned char *) 0;
   result->tofree = (SEQLIST *) 0;
@@ -43,6 +44,7 @@ SEQLIST *seq_set_next_allocate(int size, unsigned char *ref_block,
   result->alloc = 1;
   result->freed = 0;
   result->size = size;
+  result->id = 0;
   result->ref_block = ref_block;
   result->myalloc_block = (unsigned char *) 0;
   result->tofree = (SEQLIST *) 0;
@@ -65,6 +67,7 @@ SEQLIST *seq_set_next_free(SEQLIST *tofree, SEQLIST *prev) {
   result->alloc = 0;
   result->freed = 0;
   result->size = 0;
+  result->id = 0;
   result->ref_block = (unsigned char *) 0;
   result->myalloc_block = (unsigned char *) 0;
   result->tofree = tofree;
@@ -13,6 +13,7 @@ typedef struct sequence_struct {
              // 1=allocate; 0=free
   int freed; // has this block been freed
   int size; // in bytes
+  int id; // for an allocate, its number among them (set by trace_write)
   unsigned char *ref_block; // ref. block for checking data
   unsigned char *myalloc_block; // pointer to block from myalloc
   struct sequence_struct *tofree; // for a free, the sequence_struct
@@ -10,15 +10,31 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "errno.h"
 #include "myalloc.h"
 #include "sequence.h"
+#include "trace.h"
 
 #define VERBOSE 0
 
 #define DEFAULT_MAX_ALLOCATION 16000
+
+// In the thread-safe build every arena gets an equal share of the pool, so
+// the high-water mark only bounds the memory required from above.  The
+// utilization tests search for the memory required there, as -b does, and
+// score against that instead.
+#ifdef MYALLOC_THREADS
+#define HIGH_WATER_EXACT 0
+#else
+#define HIGH_WATER_EXACT 1
+#endif
 #define DEFAULT_RANDOM_SEED 1
 
 // some random numbers...
@@ -33,6 +49,10 @@ int random_int(int max) {
 }
 
 
+// Models of allocation sizes.  Each picks the size of the next block for a
+// sequence that never uses more than max_value bytes, between 1 and
+// max_value / 4 bytes.
+
 int random_block_size(int max_value) {
 
   // blah, almost certainly not a good model of
@@ -41,6 +61,134 @@ int random_block_size(int max_value) {
 
 }
 
+// sizes whose density falls off as 1/size, as in most programs: every power
+// of two is as likely as the next, and so small requests are by far the most
+// common
+int power_law_block_size(int max_value) {
+  int limit = max_value / 4;
+  int bits = 0;
+  int low;
+  int high;
+
+  while ((2 << bits) <= limit)
+    bits++;
+  low = 1 << (random_int(bits + 1) - 1);
+  high = 2 * low - 1 < limit ? 2 * low - 1 : limit;
+  return low - 1 + random_int(high - low + 1);
+}
+
+// mostly small objects, with a buffer from the top half of the range one
+// time in ten
+int bimodal_block_size(int max_value) {
+  int limit = max_value / 4;
+
+  if (random_int(10) == 1)
+    return limit / 2 + random_int(limit - limit / 2);
+  return random_int(limit < 128 ? limit : 128);
+}
+
+typedef struct size_model {
+  const char *name;
+  int (*block_size)(int max_value);
+} SIZE_MODEL;
+
+SIZE_MODEL size_models[] = {
+  { "uniform", random_block_size },
+  { "power", power_law_block_size },
+  { "bimodal", bimodal_block_size },
+  { NULL, NULL }
+};
+
+
+// Models of lifetimes.  When memory has to be freed, each picks which of
+// the count live blocks goes, by its position among them from the oldest
+// (0) to the newest (count - 1).
+
+int random_victim(int count) {
+  return random_int(count) - 1;
+}
+
+int fifo_victim(int count) {
+  return 0;
+}
+
+int lifo_victim(int count) {
+  return count - 1;
+}
+
+// most blocks die young, among the newest few, but one in eight is freed at
+// random, and whatever is passed over in that way lives a long time
+int long_tail_victim(int count) {
+  if (random_int(8) == 1)
+    return random_int(count) - 1;
+  return count - random_int(count < 8 ? count : 8);
+}
+
+typedef struct lifetime_model {
+  const char *name;
+  int (*victim)(int count);
+} LIFETIME_MODEL;
+
+LIFETIME_MODEL lifetime_models[] = {
+  { "random", random_victim },
+  { "fifo", fifo_victim },
+  { "lifo", lifo_victim },
+  { "longtail", long_tail_victim },
+  { NULL, NULL }
+};
+
+
+// The blocks of a sequence being generated that are still live, oldest
+// first, kept in blocks[first] to blocks[first + count - 1].
+typedef struct live_set {
+  SEQLIST **blocks;
+  int first;
+  int count;
+  int capacity;
+} LIVE_SET;
+
+// one removal moves at most this many blocks to keep them in order
+#define LIVE_SHIFT_MAX 8
+
+void live_add(LIVE_SET *live, SEQLIST *block) {
+  if (live->first + live->count == live->capacity) {
+    // slide the live blocks back to the front, and grow if that is not
+    // enough to leave half of the array free
+    if (live->first > 0) {
+      memmove(live->blocks, live->blocks + live->first,
+              live->count * sizeof(SEQLIST *));
+      live->first = 0;
+    }
+    if (live->count >= live->capacity / 2) {
+      live->capacity = live->capacity ? 2 * live->capacity : 1024;
+      live->blocks = (SEQLIST **) realloc(live->blocks,
+                                          live->capacity * sizeof(SEQLIST *));
+      if (live->blocks == NULL) {
+        fprintf(stderr, "real memory exhausted.\n");
+        abort();
+      }
+    }
+  }
+  live->blocks[live->first + live->count++] = block;
+}
+
+// Takes the nth oldest live block out of the set in constant time.  Blocks
+// near either end keep their order; otherwise the newest takes its place.
+SEQLIST *live_remove(LIVE_SET *live, int n) {
+  SEQLIST **slot = live->blocks + live->first + n;
+  SEQLIST *result = *slot;
+  int after = live->count - 1 - n;
+
+  if (n == 0)
+    live->first++;
+  else if (after <= LIVE_SHIFT_MAX)
+    memmove(slot, slot + 1, after * sizeof(SEQLIST *));
+  else
+    *slot = live->blocks[live->first + live->count - 1];
+  live->count--;
+  return result;
+}
+
 int random_byte() {
   return random_int(256) - 1;
 }
@@ -129,6 +277,24 @@ int binary_search_required_memory(SEQLIST *test_sequence, int low, int high) {
 }
 
 
+// the same search, replaying a trace rather than a sequence
+size_t binary_search_trace_memory(TRACE *trace, size_t low, size_t high) {
+  // invariant: low not achievable, high is achievable
+
+  while (low + 1 < high) {
+    size_t mid = low + (high - low + 1) / 2;
+    if (trace_replay(trace, mid))
+      high = mid;
+    else
+      low = mid;
+    close_myalloc();
+    if (VERBOSE)
+      printf("\t%s for %zu\n", high == mid ? "Succeeded" : "Failed", mid);
+  }
+  return high;
+}
+
+
 // allocate (from normal malloc) a block of size blocks
 //  and put data into it
 // This supports data integrity tests.
@@ -219,13 +385,15 @@ int check_data(SEQLIST *test_sequence) {
 
 
 // create a test sequence which never uses more than max_used_memory
-//   and allocates a total of max_used_memory*allocation_factor
-SEQLIST *generate_sequence(int max_used_memory, int allocation_factor) {
+//   and allocates a total of max_used_memory*allocation_factor,
+//   with sizes and lifetimes following the given models
+SEQLIST *generate_sequence(int max_used_memory, int allocation_factor,
+                           SIZE_MODEL *sizes, LIFETIME_MODEL *lifetimes) {
   int used_memory = 0;
   int total_allocated = 0;
   int next_block_size = 0;
-  int allocated_blocks = 0;
   int actual_max_used_memory = 0;
+  LIVE_SET live = { NULL, 0, 0, 0 };
 
   SEQLIST *test_sequence = NULL;
   SEQLIST *tail_sequence = NULL;
@@ -233,21 +401,19 @@ SEQLIST *generate_sequence(int max_used_memory, int allocation_factor) {
   unsigned char *new_block_ref;
 
   while (total_allocated < allocation_factor * max_used_memory) {
-    next_block_size = random_block_size(max_used_memory);
+    next_block_size = sizes->block_size(max_used_memory);
 
     // first see if we need to free anything in order to
     //  accommodate the new allocation
     while (used_memory + next_block_size > max_used_memory) {
-      // randomly pick a block to free
-      SEQLIST *tofree =
-        find_nth_allocated_block(test_sequence, random_int(allocated_blocks));
+      // pick a block to free
+      SEQLIST *tofree = live_remove(&live, lifetimes->victim(live.count));
 
       // add the free
       tail_sequence = seq_set_next_free(tofree, tail_sequence);
 
       // reclaim the memory
       used_memory -= seq_size(tofree);
-      allocated_blocks--;
 
       // mark the old block as something that has been freed
       seq_free(tofree);
@@ -277,13 +443,14 @@ SEQLIST *generate_sequence(int max_used_memory, int allocation_factor) {
     if (used_memory > actual_max_used_memory)
       actual_max_used_memory = used_memory;
 
-    allocated_blocks++;
+    live_add(&live, tail_sequence);
   }
 
   // just so can manually see this is doing something sensible
   printf("Actual maximum memory usage %d (%f)\n", actual_max_used_memory,
          ((double) actual_max_used_memory / (double) max_used_memory));
 
+  free(live.blocks);
   return test_sequence;
 }
 
@@ -395,7 +562,7 @@ int uniform_chunk_test() {
   chunks = uniform_chunks(chunk_size, MEMORY_SIZE);
 
   printf("Allocated %d uniform chunks on a first pass.\n"
-          "Theoretical maximum: %d\n", chunks, MEMORY_SIZE / chunk_size);
+          "Theoretical maximum: %zu\n", chunks, MEMORY_SIZE / chunk_size);
   if (chunks < MEMORY_SIZE / (chunk_size + 64)) {
     printf("not enough uniform chunks could be allocated.\n"
             "Too much overhead in memory allocator.\n");
@@ -419,59 +586,116 @@ int uniform_chunk_test() {
 }
 
 
+// What one utilization test found, for a sweep to collect.
+typedef struct utilization {
+  int ok;               // the final run succeeded with its data intact
+  double utilization;
+  double seconds;       // for the final run
+} UTILIZATION;
+
+
 /* This test runs a series of random allocations and deallocations,
  * to see how much overhead is required by the allocator in question
  * for a certain number of bytes to be allocated.  During the test,
  * the allocated regions are verified to not overlap with each other,
  * and so forth.
  */
-void utilization_test(int max_allocation) {
+void utilization_test(int max_allocation, SIZE_MODEL *sizes,
+                      LIFETIME_MODEL *lifetimes, char *trace_path, int search,
+                      UTILIZATION *result) {
   int max_used_memory;
   int allocation_factor;
   int memory_required;
+  int memory_searched;
+  int operations = 0;
+  clock_t start;
+  double seconds;
 
   SEQLIST *test_sequence;
+  SEQLIST *sptr;
 
   max_used_memory = max_allocation;
   allocation_factor = 11;
 
   printf("running with MAX_USED_MEMORY=%d and ALLOCATION_FACTOR=%d\n",
     max_used_memory, allocation_factor);
+  printf("with %s sizes and %s lifetimes\n", sizes->name, lifetimes->name);
 
-  test_sequence = generate_sequence(max_used_memory, allocation_factor);
+  test_sequence = generate_sequence(max_used_memory, allocation_factor,
+                                    sizes, lifetimes);
   if (VERBOSE)
     seq_print(test_sequence);
 
+  if (trace_path != NULL) {
+    if (trace_write(test_sequence, trace_path))
+      printf("Wrote the sequence to %s\n", trace_path);
+    else
+      printf("Could not write a trace to %s\n", trace_path);
+  }
+
   // check that allocation can actually do something.
   // This becomes upper bound on binary search.
   if (try_sequence(test_sequence, max_used_memory * allocation_factor * 2)) {
 
+    // The pool only grew as far as the sequence needed, so that one run
+    // tells how much memory it takes.  That can never be less than the
+    // sequence has live at once, unless the measurement missed something.
+    memory_required = myalloc_required_memory();
+
     // That call to try_sequence allocated a memory pool for myalloc, which
     // is no longer in use.
     close_myalloc();
 
-    // binary search for smallest MEMORY_SIZE which can accommodate
-    memory_required = binary_search_required_memory(test_sequence,
-      max_used_memory - 1, max_used_memory * allocation_factor * 2);
+    if (memory_required < max_used_memory) {
+      printf("Measurement problem: the high-water mark of %d bytes is below "
+             "the %d bytes live at once\n", memory_required, max_used_memory);
+      seq_cleanup(test_sequence);
+      return;
+    }
 
-    // run it one more time at the identified size.
+    if (search || !HIGH_WATER_EXACT) {
+      // binary search for smallest MEMORY_SIZE which can accommodate
+      memory_searched = binary_search_required_memory(test_sequence,
+        max_used_memory - 1, max_used_memory * allocation_factor * 2);
+      printf("Binary search found %d bytes, %s %d bytes\n",
+             memory_searched,
+             HIGH_WATER_EXACT ? "high-water mark" : "high-water upper bound",
+             memory_required);
+      if (!HIGH_WATER_EXACT)
+        memory_required = memory_searched;
+    }
+
+    // run it one more time at the identified size, timing it.
     // this makes sure that the data is set from a successful run.
+    for (sptr = test_sequence; !seq_null(sptr); sptr = seq_next(sptr))
+      operations++;
+    start = clock();
     if (try_sequence(test_sequence, memory_required)) {
+      seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+
       // check if data contents are intact
       if (check_data(test_sequence)) {
         printf("Data integrity FAIL.\n");
       }
       else {
         printf("Data integrity PASS.\n");
+        if (result != NULL)
+          result->ok = 1;
       }
 
       // print statistics
       printf("Memory utilization: (%d/%d)=%f\n", max_used_memory, memory_required,
              ((double) max_used_memory / (double) memory_required));
+      printf("Throughput: %d operations in %f seconds\n", operations, seconds);
+      if (result != NULL) {
+        result->utilization = (double) max_used_memory / (double) memory_required;
+        result->seconds = seconds;
+      }
     }
     else {
-      printf("Consistency problem: binary_search_required_memory "
-             "returned %d, but final test failed\n", memory_required);
+      close_myalloc();
+      printf("Consistency problem: the high-water mark was %d bytes, "
+             "but the final test failed\n", memory_required);
     }
   }
   else {
@@ -481,12 +705,263 @@ void utilization_test(int max_allocation) {
 }
 
 
+/* Replays a trace, written by -w or captured from a real program, in place
+ * of a random sequence.  The trace is streamed from the file on each replay,
+ * so it can be far longer than a sequence held in memory could be.  Each
+ * object's first byte is checked when it is freed, or at the end.
+ */
+void trace_utilization_test(char *trace_path, int search) {
+  TRACE *trace;
+  size_t high;
+  size_t memory_required;
+  size_t memory_searched;
+  clock_t start;
+  double seconds;
+
+  trace = trace_open(trace_path);
+  if (trace == NULL) {
+    printf("Could not read a trace from %s\n", trace_path);
+    return;
+  }
+  printf("replaying %s: %llu operations on %llu objects, at most %llu bytes\n",
+         trace_path, (unsigned long long) trace->header.ops,
+         (unsigned long long) trace->header.objects,
+         (unsigned long long) trace->header.peak_bytes);
+
+  // as with a sequence, the no-free case bounds the search, leaving room
+  // for a header on every object
+  high = 2 * trace->header.total_bytes + 64 * trace->header.objects;
+  if (trace_replay(trace, high)) {
+    memory_required = myalloc_required_memory();
+    close_myalloc();
+
+    if (memory_required < trace->header.peak_bytes) {
+      printf("Measurement problem: the high-water mark of %zu bytes is below "
+             "the %llu bytes live at once\n", memory_required,
+             (unsigned long long) trace->header.peak_bytes);
+      trace_close(trace);
+      return;
+    }
+
+    if (search || !HIGH_WATER_EXACT) {
+      memory_searched = binary_search_trace_memory(trace,
+        trace->header.peak_bytes - 1, high);
+      printf("Binary search found %zu bytes, %s %zu bytes\n",
+             memory_searched,
+             HIGH_WATER_EXACT ? "high-water mark" : "high-water upper bound",
+             memory_required);
+      if (!HIGH_WATER_EXACT)
+        memory_required = memory_searched;
+    }
+
+    start = clock();
+    if (trace_replay(trace, memory_required)) {
+      seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+      close_myalloc();
+
+      if (trace->corrupted)
+        printf("Data integrity FAIL.\n");
+      else
+        printf("Data integrity PASS.\n");
+
+      printf("Memory utilization: (%llu/%zu)=%f\n",
+             (unsigned long long) trace->header.peak_bytes, memory_required,
+             ((double) trace->header.peak_bytes / (double) memory_required));
+      printf("Throughput: %llu operations in %f seconds\n",
+             (unsigned long long) trace->header.ops, seconds);
+    }
+    else {
+      close_myalloc();
+      printf("Consistency problem: the high-water mark was %zu bytes, "
+             "but the final test failed\n", memory_required);
+    }
+  }
+  else {
+    close_myalloc();
+    printf("Requires more memory than the no-free case.\n");
+  }
+  trace_close(trace);
+}
+
+
+// the most max_allocation values one sweep takes
+#define MAX_SWEEP_SIZES 64
+
+/* Runs one utilization test in a forked process, so that every run gets a
+ * fresh allocator and the runs can go side by side.  The child's output is
+ * discarded, and its result comes back through a pipe.  Returns the child's
+ * pid, with the read end of the pipe in *fd.
+ */
+pid_t start_sweep_run(unsigned int seed, int max_allocation, SIZE_MODEL *sizes,
+                      LIFETIME_MODEL *lifetimes, int *fd) {
+  int ends[2];
+  pid_t pid;
+
+  fflush(stdout);
+  if (pipe(ends) != 0 || (pid = fork()) < 0) {
+    perror("sweep");
+    exit(1);
+  }
+  if (pid == 0) {
+    UTILIZATION result = { 0, 0.0, 0.0 };
+    int null = open("/dev/null", O_WRONLY);
+
+    close(ends[0]);
+    dup2(null, 1);
+    dup2(null, 2);
+    srand(seed);
+    utilization_test(max_allocation, sizes, lifetimes, NULL, 0, &result);
+    fflush(stdout);
+    if (write(ends[1], &result, sizeof(result)) != sizeof(result))
+      _exit(1);
+    _exit(0);
+  }
+  close(ends[1]);
+  *fd = ends[0];
+  return pid;
+}
+
+
+// mean and sample variance of n values
+void summarize(double *values, int n, double *mean, double *variance) {
+  double sum = 0.0;
+  double squares = 0.0;
+
+  for (int i = 0; i < n; i++)
+    sum += values[i];
+  *mean = n > 0 ? sum / n : 0.0;
+  for (int i = 0; i < n; i++)
+    squares += (values[i] - *mean) * (values[i] - *mean);
+  *variance = n > 1 ? squares / (n - 1) : 0.0;
+}
+
+
+/* Runs the utilization test for every seed from first_seed to last_seed at
+ * each of the given max_allocation values, up to jobs at a time, and prints
+ * one summary line per max_allocation, as CSV or as JSON, with the mean and
+ * variance of utilization and time across the seeds.  Runs that fail count
+ * as failures and are left out of the statistics.  Each line is labelled
+ * with the program's name, so the output of testers built with different
+ * placement policies can be put side by side.
+ */
+int sweep(char *program, unsigned int first_seed, unsigned int last_seed,
+          int *max_allocations, int num_sizes, SIZE_MODEL *sizes,
+          LIFETIME_MODEL *lifetimes, int jobs, int json) {
+  int seeds = last_seed - first_seed + 1;
+  int runs = seeds * num_sizes;
+  UTILIZATION *results = calloc(runs, sizeof(UTILIZATION));
+  pid_t *pids = calloc(runs, sizeof(pid_t));
+  int *fds = calloc(runs, sizeof(int));
+  double *utilizations = calloc(seeds, sizeof(double));
+  double *times = calloc(seeds, sizeof(double));
+  char *label = strrchr(program, '/') ? strrchr(program, '/') + 1 : program;
+  int started = 0;
+  int running = 0;
+
+  if (!results || !pids || !fds || !utilizations || !times) {
+    fprintf(stderr, "real memory exhausted.\n");
+    abort();
+  }
+
+  // run number i is seed first_seed + i % seeds at max_allocations[i / seeds]
+  while (started < runs || running > 0) {
+    if (started < runs && running < jobs) {
+      pids[started] = start_sweep_run(first_seed + started % seeds,
+                                      max_allocations[started / seeds],
+                                      sizes, lifetimes, &fds[started]);
+      started++;
+      running++;
+    }
+    else {
+      pid_t pid = wait(NULL);
+      for (int i = 0; i < started; i++) {
+        if (pids[i] == pid) {
+          // a run that died without reporting stays failed
+          if (read(fds[i], &results[i], sizeof(UTILIZATION))
+              != sizeof(UTILIZATION))
+            results[i].ok = 0;
+          close(fds[i]);
+          pids[i] = 0;
+          running--;
+          break;
+        }
+      }
+    }
+  }
+
+  if (json)
+    printf("[\n");
+  else
+    printf("program,max_allocation,sizes,lifetimes,seeds,failures,"
+           "utilization_mean,utilization_variance,seconds_mean,"
+           "seconds_variance\n");
+  for (int m = 0; m < num_sizes; m++) {
+    double utilization_mean, utilization_variance;
+    double seconds_mean, seconds_variance;
+    int n = 0;
+
+    for (int i = 0; i < seeds; i++) {
+      UTILIZATION *result = &results[m * seeds + i];
+      if (result->ok) {
+        utilizations[n] = result->utilization;
+        times[n] = result->seconds;
+        n++;
+      }
+    }
+    summarize(utilizations, n, &utilization_mean, &utilization_variance);
+    summarize(times, n, &seconds_mean, &seconds_variance);
+
+    if (json)
+      printf("  {\"program\": \"%s\", \"max_allocation\": %d, "
+             "\"sizes\": \"%s\", \"lifetimes\": \"%s\", \"seeds\": %d, "
+             "\"failures\": %d, \"utilization_mean\": %f, "
+             "\"utilization_variance\": %g, \"seconds_mean\": %f, "
+             "\"seconds_variance\": %g}%s\n",
+             label, max_allocations[m], sizes->name, lifetimes->name, seeds,
+             seeds - n, utilization_mean, utilization_variance, seconds_mean,
+             seconds_variance, m < num_sizes - 1 ? "," : "");
+    else
+      printf("%s,%d,%s,%s,%d,%d,%f,%g,%f,%g\n", label, max_allocations[m],
+             sizes->name, lifetimes->name, seeds, seeds - n, utilization_mean,
+             utilization_variance, seconds_mean, seconds_variance);
+  }
+  if (json)
+    printf("]\n");
+
+  free(results);
+  free(pids);
+  free(fds);
+  free(utilizations);
+  free(times);
+  return 0;
+}
+
+
 void usage(char *program) {
-  printf("usage: %s [-s seed] [-m max_allocation]\n", program);
+  printf("usage: %s [-s seed] [-m max_allocation] [-z sizes] [-l lifetimes]\n"
+         "\t[-w trace | -r trace] [-b] [-S seeds [-M sizes] [-j jobs] [-J]]\n",
+         program);
   printf("\tRuns the myalloc tester.\n\n");
   printf("\t-s seed sets the tester to use a specific random seed\n\n");
   printf("\t-m max_allocation sets the maximum number of bytes that the\n");
   printf("\ttester should try to allocate during utilization tests\n\n");
+  printf("\t-z sizes picks the model of allocation sizes: uniform (the\n");
+  printf("\tdefault), power or bimodal\n\n");
+  printf("\t-l lifetimes picks which live block is freed when memory runs\n");
+  printf("\tout: random (the default), fifo, lifo or longtail\n\n");
+  printf("\t-w trace writes the utilization test's sequence out as a trace\n\n");
+  printf("\t-r trace runs the utilization test on a trace instead of on a\n");
+  printf("\trandom sequence\n\n");
+  printf("\t-b also finds the memory required by binary search, as a check\n");
+  printf("\ton the high-water mark; the thread-safe build always does, and\n");
+  printf("\tscores against what the search finds\n\n");
+  printf("\t-S first-last sweeps the utilization test over those seeds (or\n");
+  printf("\tseeds 1 to n for -S n) in parallel, in place of the other tests,\n");
+  printf("\tand prints the mean and variance across seeds as CSV\n\n");
+  printf("\t-M m1,m2,... sweeps over these max_allocation values too\n\n");
+  printf("\t-j jobs sets how many runs of a sweep go at once, by default one\n");
+  printf("\tper processor\n\n");
+  printf("\t-J prints the summary of a sweep as JSON instead\n\n");
 }
 
 
@@ -494,20 +969,102 @@ void usage(char *program) {
 int main(int argc, char *argv[]) {
   unsigned int seed = DEFAULT_RANDOM_SEED;
   int max_allocation = DEFAULT_MAX_ALLOCATION;
+  SIZE_MODEL *sizes = &size_models[0];
+  LIFETIME_MODEL *lifetimes = &lifetime_models[0];
+  char *write_path = NULL;
+  char *replay_path = NULL;
+  int search = 0;
+  unsigned int first_seed = 0;
+  unsigned int last_seed = 0;
+  int max_allocations[MAX_SWEEP_SIZES];
+  int num_sizes = 0;
+  int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int json = 0;
+  char *size_list;
   int c;
 
-  while ((c = getopt(argc, argv, "s:m:")) != -1) {
+  while ((c = getopt(argc, argv, "s:m:z:l:w:r:bS:M:j:J")) != -1) {
     switch (c) {
       case 's':    /* Random seed */
         seed = atoi(optarg);
         break;
 
-      case 'p':
+      case 'm':
         max_allocation = atoi(optarg);
-        if (max_allocation < 0)
+        if (max_allocation < 0) {
           printf("ERROR:  Max allocation must be nonnegative.\n");
           usage(argv[0]);
           return 1;
+        }
+        break;
+
+      case 'z':    /* Size model */
+        for (sizes = size_models; sizes->name != NULL; sizes++) {
+          if (strcmp(sizes->name, optarg) == 0)
+            break;
+        }
+        if (sizes->name == NULL) {
+          printf("ERROR:  Unknown size model %s.\n", optarg);
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+
+      case 'l':    /* Lifetime model */
+        for (lifetimes = lifetime_models; lifetimes->name != NULL; lifetimes++) {
+          if (strcmp(lifetimes->name, optarg) == 0)
+            break;
+        }
+        if (lifetimes->name == NULL) {
+          printf("ERROR:  Unknown lifetime model %s.\n", optarg);
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+
+      case 'w':    /* Trace to write */
+        write_path = optarg;
+        break;
+
+      case 'r':    /* Trace to replay */
+        replay_path = optarg;
+        break;
+
+      case 'b':    /* Cross-check with a binary search */
+        search = 1;
+        break;
+
+      case 'S':    /* Seeds to sweep over */
+        if (sscanf(optarg, "%u-%u", &first_seed, &last_seed) == 1) {
+          last_seed = first_seed;
+          first_seed = 1;
+        }
+        if (first_seed == 0 || last_seed < first_seed) {
+          printf("ERROR:  Seeds must be a range first-last from 1.\n");
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+
+      case 'M':    /* Max allocations to sweep over */
+        for (size_list = strtok(optarg, ","); size_list != NULL;
+             size_list = strtok(NULL, ",")) {
+          if (num_sizes == MAX_SWEEP_SIZES || atoi(size_list) < 0) {
+            printf("ERROR:  At most %d nonnegative max allocations.\n",
+                   MAX_SWEEP_SIZES);
+            usage(argv[0]);
+            return 1;
+          }
+          max_allocations[num_sizes++] = atoi(size_list);
+        }
+        break;
+
+      case 'j':    /* Runs at once in a sweep */
+        jobs = atoi(optarg);
+        break;
+
+      case 'J':    /* Summary of a sweep as JSON */
+        json = 1;
         break;
 
       case 'h':
@@ -516,6 +1073,17 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  // Every chunk has to come out of the pool being measured, however large,
+  // or the utilization figure would leave it out.
+  myalloc_set_mmap_threshold(0);
+
+  if (first_seed != 0) {
+    if (num_sizes == 0)
+      max_allocations[num_sizes++] = max_allocation;
+    return sweep(argv[0], first_seed, last_seed, max_allocations, num_sizes,
+                 sizes, lifetimes, jobs < 1 ? 1 : jobs, json);
+  }
+
   if (seed != DEFAULT_RANDOM_SEED)
     printf("Using seed:  %u\n\n", seed);
 
@@ -530,7 +1098,11 @@ int main(int argc, char *argv[]) {
   printf("\n");
 
   // Do the memory utilization test to see how efficient the allocator is
-  utilization_test(max_allocation);
+  if (replay_path != NULL)
+    trace_utilization_test(replay_path, search);
+  else
+    utilization_test(max_allocation, sizes, lifetimes, write_path, search,
+                     NULL);
 
   return 0;
 }
@@ -0,0 +1,751 @@
+/*! \file
+ * Tests for the parts of the allocator's interface beyond myalloc() and
+ * myfree(), which the unacceptable allocator does not provide.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "myalloc.h"
+
+#define BATCH_SIZE 50
+#define OOM_CHUNK 50000
+#define PROFILE_CHUNKS 20
+#define CALLOC_SLOTS 64
+#define CALLOC_ROUNDS 5000
+#define TRIMMED_CHUNK 100000
+#define HUGE_CHUNK 50000
+#define HUGE_CHUNKS 200
+#define HANDLE_CHUNKS 200
+#define COMPACT_BUDGET 4096
+
+
+// Fills a chunk with a pattern that depends on the position of each byte.
+void fill(unsigned char *p, int size) {
+  for (int i = 0; i < size; i++)
+    p[i] = (unsigned char) (i * 7 + 1);
+}
+
+
+// Returns 1 if the first "size" bytes of a chunk still hold the pattern.
+int intact(unsigned char *p, int size) {
+  for (int i = 0; i < size; i++) {
+    if (p[i] != (unsigned char) (i * 7 + 1))
+      return 0;
+  }
+  return 1;
+}
+
+
+// Checks that myrealloc() resizes in place when it can, and keeps the data
+// whenever it has to move a chunk.  The sizes stay clear of the thread
+// caches, so that freed neighbours really are free.
+int realloc_test() {
+  unsigned char *a;
+  unsigned char *b;
+  unsigned char *c;
+  int failure = 0;
+
+  printf("Performing a basic test of myrealloc().\n");
+
+  MEMORY_SIZE = 1 << 20;
+  init_myalloc();
+
+  // Shrinking in place
+  a = myalloc(2000);
+  fill(a, 2000);
+  b = myrealloc(a, 1000);
+  if (b != a || !intact(b, 1000)) {
+    printf("Failed to shrink a chunk in place.\n");
+    failure = 1;
+    goto done;
+  }
+  myfree(b);
+
+  // Growing into a free right neighbour
+  a = myalloc(1000);
+  b = myalloc(1000);
+  c = myalloc(1000);
+  fill(a, 1000);
+  myfree(b);
+  b = myrealloc(a, 1800);
+  if (b != a || !intact(b, 1000)) {
+    printf("Failed to grow a chunk into its free neighbour.\n");
+    failure = 1;
+    goto done;
+  }
+
+  // Moving, when the neighbour is taken
+  a = myrealloc(b, 5000);
+  if (a == NULL || !intact(a, 1000)) {
+    printf("Failed to move a chunk that could not grow in place.\n");
+    failure = 1;
+    goto done;
+  }
+  myfree(a);
+  myfree(c);
+
+  // Resizing a mapped chunk, and moving it back into the pool
+  a = myrealloc(NULL, 1 << 18);
+  fill(a, 1 << 18);
+  b = myrealloc(a, 1 << 22);
+  if (b == NULL || !intact(b, 1 << 18)) {
+    printf("Failed to grow a mapped chunk.\n");
+    failure = 1;
+    goto done;
+  }
+  a = myrealloc(b, 100);
+  if (a == NULL || !intact(a, 100)) {
+    printf("Failed to shrink a mapped chunk.\n");
+    failure = 1;
+    goto done;
+  }
+  myfree(a);
+
+done:
+  if (!failure)
+    printf("Passed myrealloc() test.\n");
+  close_myalloc();
+  return failure;
+}
+
+
+// Checks that a pool of its own hands out chunks independently of the default
+// pool, and that resetting it makes all of its memory available again.
+int pool_test() {
+  pool_t *pool;
+  unsigned char *first;
+  unsigned char *p;
+  unsigned char *q;
+  int count = 0;
+  int again = 0;
+  int failure = 0;
+
+  printf("Performing a basic test of pools.\n");
+
+  MEMORY_SIZE = 1 << 20;
+  init_myalloc();
+  pool = pool_create(1 << 20);
+
+  // Chunks from the pool and from the default pool must not interfere
+  p = myalloc(1000);
+  first = pool_alloc(pool, 1000);
+  fill(p, 1000);
+  fill(first, 1000);
+  pool_free(pool, first);
+  q = pool_alloc(pool, 1000);
+  if (q != first || !intact(p, 1000)) {
+    printf("Failed to reuse a chunk freed back into a pool.\n");
+    failure = 1;
+    goto done;
+  }
+  myfree(p);
+
+  // Fill the pool, including with chunks too large for the pool's slabs
+  while (pool_alloc(pool, count % 2 ? 200 : 20000) != NULL)
+    count++;
+  pool_reset(pool);
+  p = pool_alloc(pool, 1000);
+  if (p != first) {
+    printf("Failed to start over from the beginning of a reset pool.\n");
+    failure = 1;
+    goto done;
+  }
+  pool_reset(pool);
+  while (pool_alloc(pool, again % 2 ? 200 : 20000) != NULL)
+    again++;
+  if (again < count) {
+    printf("Failed to get all of a pool's memory back by resetting it.\n");
+    failure = 1;
+    goto done;
+  }
+
+done:
+  if (!failure)
+    printf("Passed pool test.\n");
+  pool_destroy(pool);
+  close_myalloc();
+  return failure;
+}
+
+
+// Checks that a batch of chunks is carved back to back, and that freeing the
+// batch, in any order, leaves the heap as it was.
+int batch_test() {
+  unsigned char *chunks[BATCH_SIZE];
+  unsigned char *first;
+  int failure = 0;
+
+  printf("Performing a basic test of batch allocation.\n");
+
+  MEMORY_SIZE = 1 << 20;
+  init_myalloc();
+
+  if (myalloc_batch(100, BATCH_SIZE, chunks) != BATCH_SIZE) {
+    printf("Failed to allocate a whole batch.\n");
+    failure = 1;
+    goto done;
+  }
+  first = chunks[0];
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    if (chunks[i] - chunks[0] != i * (chunks[1] - chunks[0])) {
+      printf("Failed to carve a batch out of one contiguous region.\n");
+      failure = 1;
+      goto done;
+    }
+    fill(chunks[i], 100);
+  }
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    if (!intact(chunks[i], 100)) {
+      printf("Failed to keep the chunks of a batch apart.\n");
+      failure = 1;
+      goto done;
+    }
+  }
+
+  // Free the batch out of order, and check that it all coalesced again
+  for (int i = 0; i < BATCH_SIZE / 2; i++) {
+    unsigned char *swap = chunks[i];
+    chunks[i] = chunks[BATCH_SIZE - 1 - i];
+    chunks[BATCH_SIZE - 1 - i] = swap;
+  }
+  myfree_batch(chunks, BATCH_SIZE);
+  if (myalloc_batch(100, BATCH_SIZE, chunks) != BATCH_SIZE
+      || chunks[0] != first) {
+    printf("Failed to free a whole batch.\n");
+    failure = 1;
+    goto done;
+  }
+  myfree_batch(chunks, BATCH_SIZE);
+
+done:
+  if (!failure)
+    printf("Passed batch allocation test.\n");
+  close_myalloc();
+  return failure;
+}
+
+
+// Checks that the statistics follow allocations and frees, and that a walk
+// over the heap agrees with the counters kept along the way.
+int stats_test() {
+  unsigned char *chunks[BATCH_SIZE];
+  myalloc_stats_t before;
+  myalloc_stats_t stats;
+  myalloc_heap_t heap;
+  int failure = 0;
+
+  printf("Performing a basic test of allocator statistics.\n");
+
+  MEMORY_SIZE = 1 << 20;
+  init_myalloc();
+
+  myalloc_stats(&before);
+  for (int i = 0; i < BATCH_SIZE; i++)
+    chunks[i] = myalloc(1000 + i);
+  // free every other chunk, leaving holes that cannot coalesce
+  for (int i = 0; i < BATCH_SIZE; i += 2)
+    myfree(chunks[i]);
+  myalloc_stats(&stats);
+  if (stats.allocs - before.allocs != BATCH_SIZE
+      || stats.frees - before.frees != BATCH_SIZE / 2
+      || stats.in_use < (BATCH_SIZE / 2) * 1000) {
+    printf("Failed to count allocations and frees.\n");
+    failure = 1;
+    goto done;
+  }
+
+  // the counts by NUMA node add up to the totals
+  {
+    size_t node_in_use = 0;
+    size_t node_committed = 0;
+    for (int i = 0; i < stats.nodes; i++) {
+      node_in_use += stats.node_in_use[i];
+      node_committed += stats.node_committed[i];
+    }
+    if (stats.nodes < 1 || stats.nodes > MYALLOC_MAX_NODES
+        || node_in_use != stats.in_use || node_committed == 0) {
+      printf("Failed to count memory by NUMA node.\n");
+      failure = 1;
+      goto done;
+    }
+  }
+
+  myalloc_heap_walk(&heap);
+  if (heap.free_blocks != stats.free_blocks
+      || heap.free_bytes != stats.free_bytes
+      || heap.largest_free != stats.largest_free
+      || heap.free_blocks < BATCH_SIZE / 2
+      || heap.fragmentation <= 0.0 || heap.fragmentation >= 1.0) {
+    printf("Failed to agree on the free blocks when walking the heap.\n");
+    failure = 1;
+    goto done;
+  }
+
+  // once everything is freed, the free memory is all in one block again
+  for (int i = 1; i < BATCH_SIZE; i += 2)
+    myfree(chunks[i]);
+  myalloc_trim();
+  myalloc_heap_walk(&heap);
+  myalloc_stats(&stats);
+  if (heap.free_blocks != 1 || heap.fragmentation != 0.0
+      || stats.coalesces == 0 || stats.peak_footprint < BATCH_SIZE * 1000) {
+    printf("Failed to report a coalesced heap.\n");
+    failure = 1;
+    goto done;
+  }
+
+done:
+  if (!failure)
+    printf("Passed allocator statistics test.\n");
+  close_myalloc();
+  return failure;
+}
+
+
+// What the out-of-memory handler below does, a chunk it may free to make room,
+// and how often each hook was called.
+int oom_action;
+unsigned char *oom_reserve;
+int oom_calls;
+int diagnostics;
+
+
+int handle_oom(size_t size, int attempt) {
+  oom_calls++;
+  if (oom_action == MYALLOC_OOM_RETRY) {
+    if (oom_reserve == NULL)
+      return MYALLOC_OOM_FAIL;
+    myfree(oom_reserve);
+    oom_reserve = NULL;
+  }
+  return oom_action;
+}
+
+
+void count_diagnostic(const char *message) {
+  diagnostics++;
+}
+
+
+// Checks that a full pool asks the out-of-memory handler what to do, and that
+// failures are reported through the diagnostic hook, at a limited rate.
+int oom_test() {
+  unsigned char *chunks[BATCH_SIZE];
+  unsigned char *p;
+  int count = 0;
+  int failure = 0;
+
+  printf("Performing a basic test of out-of-memory handling.\n");
+
+  MEMORY_SIZE = 1 << 20;
+  init_myalloc();
+  myalloc_set_diagnostic_hook(count_diagnostic, 60000);
+
+  while (count < BATCH_SIZE && (chunks[count] = myalloc(OOM_CHUNK)) != NULL)
+    count++;
+  if (count == BATCH_SIZE || diagnostics != 1) {
+    printf("Failed to report running out of memory.\n");
+    failure = 1;
+    goto done;
+  }
+  for (int i = 0; i < 10; i++)
+    myalloc(OOM_CHUNK);
+  if (diagnostics != 1) {
+    printf("Failed to hold back repeated diagnostics.\n");
+    failure = 1;
+    goto done;
+  }
+
+  // Reclaim a chunk and retry
+  myalloc_set_oom_handler(handle_oom);
+  oom_action = MYALLOC_OOM_RETRY;
+  oom_reserve = chunks[--count];
+  p = myalloc(OOM_CHUNK);
+  if (p == NULL || oom_calls != 1 || oom_reserve != NULL) {
+    printf("Failed to retry once the handler had reclaimed memory.\n");
+    failure = 1;
+    goto done;
+  }
+  chunks[count++] = p;
+
+  // Grow past the pool
+  oom_action = MYALLOC_OOM_GROW;
+  p = myalloc(OOM_CHUNK);
+  if (p == NULL) {
+    printf("Failed to grow past a full pool.\n");
+    failure = 1;
+    goto done;
+  }
+  fill(p, OOM_CHUNK);
+  if (!intact(p, OOM_CHUNK)) {
+    printf("Failed to keep the contents of a chunk grown past the pool.\n");
+    failure = 1;
+    goto done;
+  }
+  myfree(p);
+
+  // Fail quietly
+  oom_action = MYALLOC_OOM_FAIL;
+  if (myalloc(OOM_CHUNK) != NULL || diagnostics != 1) {
+    printf("Failed to fail quietly.\n");
+    failure = 1;
+    goto done;
+  }
+
+done:
+  if (!failure)
+    printf("Passed out-of-memory handling test.\n");
+  for (int i = 0; i < count; i++)
+    myfree(chunks[i]);
+  myalloc_set_oom_handler(NULL);
+  myalloc_set_diagnostic_hook(NULL, 1000);
+  close_myalloc();
+  return failure;
+}
+
+
+// Checks that with a sampling period of one byte every chunk is sampled, and
+// that the dumped profile counts the live ones and all of them, including a
+// chunk that myrealloc() failed to resize.
+int profile_test() {
+  unsigned char *chunks[PROFILE_CHUNKS];
+  size_t live[2];
+  size_t total[2];
+  size_t period;
+  FILE *dump;
+  int failure = 0;
+
+  printf("Performing a basic test of the heap profiler.\n");
+
+  MEMORY_SIZE = 1 << 20;
+  init_myalloc();
+  dump = tmpfile();
+
+  if (!myalloc_profile_start(1)) {
+    printf("Failed to start the heap profiler.\n");
+    failure = 1;
+    goto done;
+  }
+  for (int i = 0; i < PROFILE_CHUNKS; i++) {
+    chunks[i] = myalloc(100);
+    fill(chunks[i], 100);
+  }
+  for (int i = 0; i < PROFILE_CHUNKS; i += 2)
+    myfree(chunks[i]);
+  myalloc_profile_stop();
+  for (int i = 1; i < PROFILE_CHUNKS; i += 2) {
+    if (!intact(chunks[i], 100)) {
+      printf("Failed to keep the contents of sampled chunks.\n");
+      failure = 1;
+      goto done;
+    }
+  }
+  if (myrealloc(chunks[1], (size_t) 1 << 60) != NULL) {
+    printf("Failed to refuse an impossible myrealloc().\n");
+    failure = 1;
+    goto done;
+  }
+
+  if (!myalloc_profile_dump(fileno(dump))
+      || fseek(dump, 0, SEEK_SET) != 0
+      || fscanf(dump, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu",
+                &live[0], &live[1], &total[0], &total[1], &period) != 5
+      || live[0] != PROFILE_CHUNKS / 2 || live[1] != PROFILE_CHUNKS / 2 * 100
+      || total[0] != PROFILE_CHUNKS || total[1] != PROFILE_CHUNKS * 100) {
+    printf("Failed to dump the live and cumulative profiles.\n");
+    failure = 1;
+    goto done;
+  }
+  for (int i = 1; i < PROFILE_CHUNKS; i += 2)
+    myfree(chunks[i]);
+
+done:
+  if (!failure)
+    printf("Passed heap profiler test.\n");
+  fclose(dump);
+  close_myalloc();
+  return failure;
+}
+
+
+// Returns 1 if the first "size" bytes of a chunk are all zero.
+int zeroed(unsigned char *p, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    if (p[i] != 0)
+      return 0;
+  }
+  return 1;
+}
+
+
+// Checks that mycalloc() always hands out zeroed chunks, whether they come
+// from fresh memory, from blocks that held data, from trimmed pages or from a
+// mapping of their own, and that it refuses sizes that overflow.
+int calloc_test() {
+  unsigned char *chunks[CALLOC_SLOTS] = { 0 };
+  int failure = 0;
+
+  printf("Performing a basic test of mycalloc().\n");
+
+  MEMORY_SIZE = 1 << 24;
+  init_myalloc();
+  srand(7);
+
+  for (int round = 0; round < CALLOC_ROUNDS && !failure; round++) {
+    int slot = rand() % CALLOC_SLOTS;
+    size_t size = rand() % 8 == 0 ? 150000 + rand() % 50000
+                                  : 1 + rand() % 20000;
+    if (chunks[slot] != 0)
+      myfree(chunks[slot]);
+    if (rand() % 2) {
+      chunks[slot] = mycalloc(size / 8 + 1, 8);
+      size = size / 8 * 8 + 8;
+      if (chunks[slot] == 0 || !zeroed(chunks[slot], size)) {
+        printf("Failed to zero a chunk of %zu bytes.\n", size);
+        failure = 1;
+      }
+    }
+    else {
+      chunks[slot] = myalloc(size);
+    }
+    // leave data behind for later chunks to be carved from
+    if (chunks[slot] != 0)
+      memset(chunks[slot], 0xa5, size);
+    if (round % 500 == 0)
+      myalloc_trim();
+  }
+
+  if (!failure && mycalloc((size_t) -1 / 2, 3) != 0) {
+    printf("Failed to refuse a size that overflows.\n");
+    failure = 1;
+  }
+
+  for (int i = 0; i < CALLOC_SLOTS; i++) {
+    if (chunks[i] != 0)
+      myfree(chunks[i]);
+  }
+  if (!failure)
+    printf("Passed mycalloc() test.\n");
+  close_myalloc();
+  return failure;
+}
+
+
+// Checks that mycalloc() does not clear the pages of a block that were trimmed
+// while it was free, which read as zeros already.  Two neighbours freed one
+// after the other make a block large enough to be trimmed, and clearing the
+// pages of the first would fault them back in.
+int trimmed_calloc_test() {
+  long page = sysconf(_SC_PAGESIZE);
+  unsigned char resident[TRIMMED_CHUNK / 4096 + 1];
+  unsigned char *first;
+  unsigned char *second;
+  unsigned char *guard;
+  unsigned char *chunk;
+  unsigned char *from;
+  unsigned char *to;
+  int failure = 0;
+
+  printf("Performing a test of mycalloc() on trimmed pages.\n");
+
+  MEMORY_SIZE = 1 << 24;
+  init_myalloc();
+
+  first = myalloc(TRIMMED_CHUNK);
+  second = myalloc(TRIMMED_CHUNK);
+  guard = myalloc(100);
+  memset(first, 0xa5, TRIMMED_CHUNK);
+  memset(second, 0xa5, TRIMMED_CHUNK);
+  myfree(second);
+  myfree(first);
+
+  chunk = mycalloc(TRIMMED_CHUNK / 8, 8);
+  from = (unsigned char *) (((size_t) chunk + page - 1) & ~(page - 1)) + page;
+  to = (unsigned char *) (((size_t) chunk + TRIMMED_CHUNK) & ~(page - 1));
+  if (chunk != first) {
+    printf("Failed to reuse the trimmed block.\n");
+    failure = 1;
+  }
+  else if (mincore(from, to - from, resident) != 0) {
+    printf("Failed to find which pages are resident.\n");
+    failure = 1;
+  }
+  else {
+    for (long i = 0; i < (to - from) / page; i++) {
+      if (resident[i] & 1) {
+        printf("Failed to leave the trimmed pages alone.\n");
+        failure = 1;
+        break;
+      }
+    }
+  }
+  if (chunk != 0 && !zeroed(chunk, TRIMMED_CHUNK)) {
+    printf("Failed to zero a chunk of trimmed pages.\n");
+    failure = 1;
+  }
+
+  if (chunk != 0)
+    myfree(chunk);
+  myfree(guard);
+  if (!failure)
+    printf("Passed mycalloc() test on trimmed pages.\n");
+  close_myalloc();
+  return failure;
+}
+
+
+// Checks that a pool asked to use huge pages works whether or not the system
+// has them, and that the statistics say which it got.  Asking for hugetlb
+// pages falls back to transparent ones, and then to ordinary pages.  On a
+// system with neither, only the fallback is checked, and the test says so.
+int huge_page_test() {
+  unsigned char *chunks[HUGE_CHUNKS];
+  myalloc_stats_t stats;
+  int backed = 0;
+  int failure = 0;
+
+  printf("Performing a basic test of huge page backing.\n");
+
+  for (int mode = MYALLOC_HUGE_TRANSPARENT; mode <= MYALLOC_HUGE_TLB; mode++) {
+    MEMORY_SIZE = 1 << 26;
+    myalloc_set_huge_pages(mode);
+    init_myalloc();
+    myalloc_set_huge_pages(MYALLOC_HUGE_NONE);
+
+    for (int i = 0; i < HUGE_CHUNKS; i++) {
+      chunks[i] = myalloc(HUGE_CHUNK + i);
+      if (chunks[i] != 0)
+        fill(chunks[i], HUGE_CHUNK + i);
+    }
+    myalloc_stats(&stats);
+    for (int i = 0; i < HUGE_CHUNKS && !failure; i++) {
+      if (chunks[i] == 0 || !intact(chunks[i], HUGE_CHUNK + i)) {
+        printf("Failed to keep the data of chunk %d in mode %d.\n", i, mode);
+        failure = 1;
+      }
+    }
+    if (!failure && stats.huge_page_size != 0
+        && stats.huge_committed < (size_t) HUGE_CHUNKS * HUGE_CHUNK) {
+      printf("Failed to count the committed huge pages in mode %d.\n", mode);
+      failure = 1;
+    }
+    // without huge pages, the pool falls back to ordinary ones
+    if (!failure && stats.huge_page_size == 0 && stats.huge_committed != 0) {
+      printf("Failed to report no huge pages in mode %d.\n", mode);
+      failure = 1;
+    }
+    if (stats.huge_page_size != 0)
+      backed++;
+
+    // trimming leaves the pool usable, releasing only whole huge pages
+    for (int i = 0; i < HUGE_CHUNKS; i += 2)
+      myfree(chunks[i]);
+    myalloc_trim();
+    for (int i = 1; i < HUGE_CHUNKS && !failure; i += 2) {
+      if (!intact(chunks[i], HUGE_CHUNK + i)) {
+        printf("Failed to keep the data of chunk %d after trimming.\n", i);
+        failure = 1;
+      }
+    }
+    close_myalloc();
+  }
+
+  if (!failure && backed == 0)
+    printf("SKIP huge page test: the system provides no huge pages, so only "
+           "the fallback to ordinary pages was tested.\n");
+  else if (!failure)
+    printf("Passed huge page test.\n");
+  return failure;
+}
+
+
+// Checks that the compactor closes up the holes between movable chunks in
+// bounded slices, leaving pinned chunks where they are and every chunk's data
+// as it was.
+int compact_test() {
+  myalloc_handle_t handles[HANDLE_CHUNKS] = { 0 };
+  myalloc_heap_t before;
+  myalloc_heap_t after;
+  myalloc_stats_t stats;
+  unsigned char *pinned;
+  int slices = 0;
+  int failure = 0;
+
+  printf("Performing a basic test of handles and compaction.\n");
+
+  MEMORY_SIZE = 1 << 24;
+  init_myalloc();
+
+  for (int i = 0; i < HANDLE_CHUNKS; i++) {
+    int size = 100 + i * 37 % 3000;
+    handles[i] = myalloc_handle(size);
+    if (handles[i] == 0) {
+      printf("Failed to allocate a handle.\n");
+      failure = 1;
+      goto done;
+    }
+    fill(handle_pin(handles[i]), size);
+    handle_unpin(handles[i]);
+  }
+  // leave a hole after every other chunk, and one chunk pinned
+  for (int i = 0; i < HANDLE_CHUNKS; i += 2) {
+    myfree_handle(handles[i]);
+    handles[i] = 0;
+  }
+  pinned = handle_pin(handles[HANDLE_CHUNKS / 2 + 1]);
+
+  myalloc_heap_walk(&before);
+  while (myalloc_compact(COMPACT_BUDGET))
+    slices++;
+  myalloc_heap_walk(&after);
+  myalloc_stats(&stats);
+  if (slices < 2 || stats.compacted == 0
+      || after.free_blocks >= before.free_blocks
+      || after.largest_free <= before.largest_free) {
+    printf("Failed to compact the heap in slices.\n");
+    failure = 1;
+  }
+  if (handle_pin(handles[HANDLE_CHUNKS / 2 + 1]) != pinned) {
+    printf("Failed to leave a pinned chunk in place.\n");
+    failure = 1;
+  }
+  handle_unpin(handles[HANDLE_CHUNKS / 2 + 1]);
+  handle_unpin(handles[HANDLE_CHUNKS / 2 + 1]);
+  for (int i = 1; i < HANDLE_CHUNKS; i += 2) {
+    if (!intact(handle_pin(handles[i]), 100 + i * 37 % 3000)) {
+      printf("Failed to keep the data of a moved chunk.\n");
+      failure = 1;
+    }
+    handle_unpin(handles[i]);
+  }
+
+done:
+  for (int i = 0; i < HANDLE_CHUNKS; i++)
+    myfree_handle(handles[i]);
+  if (!failure)
+    printf("Passed handle and compaction test.\n");
+  close_myalloc();
+  return failure;
+}
+
+
+int main(int argc, char *argv[]) {
+  int failures = 0;
+
+  failures += realloc_test();
+  failures += pool_test();
+  failures += batch_test();
+  failures += stats_test();
+  failures += oom_test();
+  failures += profile_test();
+  failures += calloc_test();
+  failures += trimmed_calloc_test();
+  failures += huge_page_test();
+  failures += compact_test();
+
+  return failures != 0;
+}
@@ -0,0 +1,209 @@
+/*! \file
+ * A multi-threaded tester for the thread-safe build of the memory allocator
+ * ("make THREADS=1").  Several threads allocate and free blocks of random
+ * sizes at the same time, and check that no block they own gets corrupted.
+ * Some blocks are handed over to be freed by a different thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "myalloc.h"
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_ITERATIONS 200000
+#define LIVE_BLOCKS 256
+#define MAX_BLOCK_SIZE 2000
+#define HANDOFF_SLOTS 64
+#define PIECE_SIZE (64 * 1024)
+
+
+typedef struct worker {
+  pthread_t thread;
+  unsigned int seed;
+  int iterations;
+  int failures;   // allocation failures, which are tolerated
+  int corrupted;  // blocks whose contents changed while they were owned
+} WORKER;
+
+
+// Blocks in transit between threads.  Each entry is a block allocated by one
+// thread, waiting to be checked and freed by whichever thread swaps it out.
+unsigned char *handoff[HANDOFF_SLOTS];
+int handoff_size[HANDOFF_SLOTS];
+
+
+// The pattern a block is filled with, derived from its address.
+unsigned char pattern(unsigned char *block) {
+  return (unsigned char) ((unsigned long) block >> 4);
+}
+
+
+// Returns 1 if a block of "size" bytes still holds its pattern.
+int intact(unsigned char *block, int size) {
+  for (int j = 0; j < size; j++) {
+    if (block[j] != pattern(block))
+      return 0;
+  }
+  return 1;
+}
+
+
+// Parks a freshly filled block in a random handoff slot, and frees whatever
+// another thread left there.  The slot's size is published before the block.
+void exchange(WORKER *w, unsigned char *block, int size) {
+  int slot = rand_r(&w->seed) % HANDOFF_SLOTS;
+  int old_size;
+  unsigned char *old;
+
+  // claim the slot first, so its size cannot change under us
+  while ((old = __atomic_exchange_n(&handoff[slot], (unsigned char *) 1,
+                                    __ATOMIC_ACQUIRE)) == (unsigned char *) 1)
+    ;
+  old_size = handoff_size[slot];
+  handoff_size[slot] = size;
+  __atomic_store_n(&handoff[slot], block, __ATOMIC_RELEASE);
+
+  if (old != NULL) {
+    if (!intact(old, old_size))
+      w->corrupted++;
+    myfree(old);
+  }
+}
+
+
+// Runs a random mix of allocations and frees, keeping up to LIVE_BLOCKS
+// blocks alive and filling each with a pattern derived from its address.
+void *churn(void *arg) {
+  WORKER *w = (WORKER *) arg;
+  unsigned char *blocks[LIVE_BLOCKS] = { 0 };
+  int sizes[LIVE_BLOCKS];
+
+  for (int i = 0; i < w->iterations; i++) {
+    int slot = rand_r(&w->seed) % LIVE_BLOCKS;
+
+    if (blocks[slot] != NULL) {
+      if (!intact(blocks[slot], sizes[slot]))
+        w->corrupted++;
+      // every so often, let another thread free the block instead
+      if (rand_r(&w->seed) % 8 == 0)
+        exchange(w, blocks[slot], sizes[slot]);
+      else
+        myfree(blocks[slot]);
+      blocks[slot] = NULL;
+    }
+    else {
+      // mostly small blocks, like a typical heap
+      int size = rand_r(&w->seed) % 4 == 0 ?
+        rand_r(&w->seed) % MAX_BLOCK_SIZE : rand_r(&w->seed) % 128;
+      blocks[slot] = myalloc(size);
+      if (blocks[slot] == NULL) {
+        w->failures++;
+        continue;
+      }
+      sizes[slot] = size;
+      for (int j = 0; j < size; j++)
+        blocks[slot][j] = pattern(blocks[slot]);
+    }
+  }
+
+  for (int slot = 0; slot < LIVE_BLOCKS; slot++) {
+    if (blocks[slot] != NULL)
+      myfree(blocks[slot]);
+  }
+  return NULL;
+}
+
+
+void usage(char *program) {
+  printf("usage: %s [-t threads] [-n iterations]\n", program);
+  printf("\tRuns the multi-threaded myalloc tester.\n\n");
+  printf("\t-t threads sets the number of concurrent worker threads\n\n");
+  printf("\t-n iterations sets the operations performed by each thread\n\n");
+}
+
+
+int main(int argc, char *argv[]) {
+  int threads = DEFAULT_THREADS;
+  int iterations = DEFAULT_ITERATIONS;
+  int corrupted = 0;
+  int failures = 0;
+  WORKER *workers;
+  int c;
+
+  while ((c = getopt(argc, argv, "t:n:h")) != -1) {
+    switch (c) {
+      case 't':
+        threads = atoi(optarg);
+        break;
+
+      case 'n':
+        iterations = atoi(optarg);
+        break;
+
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  // leave enough room that every thread can keep all of its blocks live,
+  // with plenty to spare for what the threads hold in their caches
+  MEMORY_SIZE = threads * LIVE_BLOCKS * MAX_BLOCK_SIZE * 2;
+  init_myalloc();
+
+  printf("Running %d threads of %d operations each.\n", threads, iterations);
+
+  workers = malloc(sizeof(WORKER) * threads);
+  for (int i = 0; i < threads; i++) {
+    workers[i].seed = i + 1;
+    workers[i].iterations = iterations;
+    workers[i].failures = 0;
+    workers[i].corrupted = 0;
+    pthread_create(&workers[i].thread, NULL, churn, &workers[i]);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    corrupted += workers[i].corrupted;
+    failures += workers[i].failures;
+  }
+  free(workers);
+
+  // free whatever was still in transit
+  for (int slot = 0; slot < HANDOFF_SLOTS; slot++) {
+    if (handoff[slot] != NULL) {
+      if (!intact(handoff[slot], handoff_size[slot]))
+        corrupted++;
+      myfree(handoff[slot]);
+      handoff[slot] = NULL;
+    }
+  }
+
+  // once every thread has exited, the pool should be free again; it may be
+  // split into arenas, so reclaim it in pieces small enough that they come
+  // from the pool rather than being mapped on their own
+  int num_pieces = MEMORY_SIZE / PIECE_SIZE;
+  unsigned char **pieces = malloc(sizeof(unsigned char *) * num_pieces);
+  int reclaimed = 0;
+  while (reclaimed < num_pieces && (pieces[reclaimed] = myalloc(PIECE_SIZE)))
+    reclaimed++;
+  for (int i = 0; i < reclaimed; i++)
+    myfree(pieces[i]);
+  free(pieces);
+
+  if (failures)
+    printf("%d allocations failed.\n", failures);
+  if (corrupted)
+    printf("Data integrity FAIL: %d blocks corrupted.\n", corrupted);
+  else
+    printf("Data integrity PASS.\n");
+  if (reclaimed < num_pieces / 2)
+    printf("Memory was not returned to the pool after the threads exited.\n");
+  else
+    printf("Passed thread teardown test.\n");
+
+  close_myalloc();
+  return corrupted || reclaimed < num_pieces / 2;
+}
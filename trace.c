@@ -0,0 +1,273 @@
+/*! \file
+ * The definitions in this file write sequences of allocations and
+ * deallocations out as binary traces, and replay traces to the allocator
+ * straight from a mapping of the file, without building a sequence.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "myalloc.h"
+#include "sequence.h"
+#include "trace.h"
+
+// During a replay, the low bit of an object's pointer marks it as having no
+// bytes to hold its pattern.
+#define EMPTY_OBJECT 1
+
+
+static uint64_t zigzag(int64_t value) {
+  return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+  return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+static int put_varint(unsigned char *out, uint64_t value) {
+  int length = 0;
+  while (value >= 0x80) {
+    out[length++] = (unsigned char) ((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out[length++] = (unsigned char) value;
+  return length;
+}
+
+int trace_record(unsigned char *buffer, int op, int64_t id_delta,
+                 int64_t size_delta) {
+  int length = put_varint(buffer, zigzag(id_delta) << 2 | op);
+  if (op != TRACE_FREE)
+    length += put_varint(buffer + length, zigzag(size_delta));
+  return length;
+}
+
+// Decodes a varint at *p, advancing past it, or returns 0 and leaves *p at
+// end if the trace ends in the middle of it.
+static inline uint64_t get_varint(const unsigned char **p,
+                                  const unsigned char *end) {
+  uint64_t value = 0;
+  int shift = 0;
+  while (*p < end) {
+    unsigned char byte = *(*p)++;
+    value |= (uint64_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return value;
+    shift += 7;
+  }
+  return 0;
+}
+
+
+int trace_write(SEQLIST *seq, const char *path) {
+  TRACE_HEADER header;
+  SEQLIST *sptr;
+  int64_t prev_id = 0;
+  int64_t prev_size = 0;
+  uint64_t live = 0;
+  unsigned char record[TRACE_RECORD_MAX];
+  int ok;
+  FILE *out = fopen(path, "wb");
+
+  if (out == NULL)
+    return 0;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  // the header is written again once the totals are known
+  fwrite(&header, sizeof(header), 1, out);
+
+  for (sptr = seq; !seq_null(sptr); sptr = seq_next(sptr)) {
+    int64_t id;
+    if (seq_alloc(sptr)) {
+      sptr->id = header.objects++;
+      id = sptr->id;
+      live += seq_size(sptr);
+      header.total_bytes += seq_size(sptr);
+      if (live > header.peak_bytes)
+        header.peak_bytes = live;
+      fwrite(record, trace_record(record, TRACE_ALLOC, id - prev_id,
+                                  seq_size(sptr) - prev_size), 1, out);
+      prev_size = seq_size(sptr);
+    }
+    else {
+      id = seq_tofree(sptr)->id;
+      live -= seq_size(seq_tofree(sptr));
+      fwrite(record, trace_record(record, TRACE_FREE, id - prev_id, 0), 1, out);
+    }
+    prev_id = id;
+    header.ops++;
+  }
+
+  ok = fseek(out, 0, SEEK_SET) == 0
+       && fwrite(&header, sizeof(header), 1, out) == 1;
+  return fclose(out) == 0 && ok;
+}
+
+
+TRACE *trace_open(const char *path) {
+  TRACE *trace;
+  struct stat info;
+  void *data;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof(TRACE_HEADER)) {
+    close(fd);
+    return NULL;
+  }
+  data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+  if (memcmp(data, TRACE_MAGIC, 8) != 0) {
+    munmap(data, info.st_size);
+    return NULL;
+  }
+
+  trace = (TRACE *) malloc(sizeof(TRACE));
+  if (trace == NULL) {
+    munmap(data, info.st_size);
+    return NULL;
+  }
+  trace->data = (unsigned char *) data;
+  trace->length = info.st_size;
+  memcpy(&trace->header, data, sizeof(TRACE_HEADER));
+  trace->corrupted = 0;
+  return trace;
+}
+
+
+// Each live object holds the low byte of its number in its first byte.
+static void fill_object(unsigned char *block, int64_t id, int64_t size) {
+  if (size > 0)
+    block[0] = (unsigned char) id;
+}
+
+static unsigned char *tag_object(unsigned char *block, int64_t size) {
+  return size > 0 ? block : (unsigned char *) ((uintptr_t) block | EMPTY_OBJECT);
+}
+
+static unsigned char *object_block(unsigned char *object) {
+  return (unsigned char *) ((uintptr_t) object & ~(uintptr_t) EMPTY_OBJECT);
+}
+
+static int object_intact(unsigned char *object, int64_t id) {
+  return ((uintptr_t) object & EMPTY_OBJECT) || object[0] == (unsigned char) id;
+}
+
+
+int trace_replay(TRACE *trace, size_t mem_size) {
+  const unsigned char *p = trace->data + sizeof(TRACE_HEADER);
+  const unsigned char *end = trace->data + trace->length;
+  unsigned char **objects;
+  int64_t prev_id = 0;
+  int64_t prev_size = 0;
+  int result = 1;
+
+  objects = (unsigned char **) calloc(trace->header.objects + 1,
+                                      sizeof(unsigned char *));
+  if (objects == NULL) {
+    fprintf(stderr, "real memory exhausted.\n");
+    abort();
+  }
+  trace->corrupted = 0;
+  madvise(trace->data, trace->length, MADV_SEQUENTIAL);
+
+  // reset the memory allocator being tested
+  MEMORY_SIZE = mem_size;
+  init_myalloc();
+
+  for (uint64_t i = 0; i < trace->header.ops && result; i++) {
+    uint64_t tag = get_varint(&p, end);
+    int64_t id = prev_id + unzigzag(tag >> 2);
+    unsigned char *block;
+
+    if (p >= end && i + 1 < trace->header.ops) {
+      fprintf(stderr, "trace ends after %llu of %llu records.\n",
+              (unsigned long long) i, (unsigned long long) trace->header.ops);
+      result = 0;
+      break;
+    }
+    if (id < 0 || (uint64_t) id >= trace->header.objects) {
+      fprintf(stderr, "trace record %llu names object %lld out of range.\n",
+              (unsigned long long) i, (long long) id);
+      result = 0;
+      break;
+    }
+    prev_id = id;
+    if ((tag & 3) == TRACE_ALLOC || (tag & 3) == TRACE_REALLOC) {
+      prev_size += unzigzag(get_varint(&p, end));
+      if (prev_size < 0) {
+        fprintf(stderr, "trace record %llu has a negative size %lld.\n",
+                (unsigned long long) i, (long long) prev_size);
+        result = 0;
+        break;
+      }
+    }
+
+    switch (tag & 3) {
+      case TRACE_ALLOC:
+        if (objects[id] != NULL) {
+          fprintf(stderr, "trace record %llu allocates object %lld, which "
+                  "is still live.\n", (unsigned long long) i, (long long) id);
+          result = 0;
+          break;
+        }
+        block = myalloc(prev_size);
+        if (block == NULL) {
+          result = 0;   // failed -- return indication
+          break;
+        }
+        fill_object(block, id, prev_size);
+        objects[id] = tag_object(block, prev_size);
+        break;
+
+      case TRACE_REALLOC:
+        // replayed as an allocate and a free, which every allocator tested
+        // here provides, holding both at once as a moving realloc would
+        block = myalloc(prev_size);
+        if (block == NULL) {
+          result = 0;
+          break;
+        }
+        if (objects[id] != NULL) {
+          if (!object_intact(objects[id], id))
+            trace->corrupted++;
+          myfree(object_block(objects[id]));
+        }
+        fill_object(block, id, prev_size);
+        objects[id] = tag_object(block, prev_size);
+        break;
+
+      default:    // dealloc
+        if (objects[id] == NULL)
+          break;
+        if (!object_intact(objects[id], id))
+          trace->corrupted++;
+        myfree(object_block(objects[id]));
+        objects[id] = NULL;
+        break;
+    }
+  }
+
+  // whatever is still live must have kept its data too
+  for (uint64_t id = 0; id < trace->header.objects; id++) {
+    if (objects[id] != NULL && !object_intact(objects[id], id))
+      trace->corrupted++;
+  }
+  free(objects);
+  return result;
+}
+
+
+void trace_close(TRACE *trace) {
+  munmap(trace->data, trace->length);
+  free(trace);
+}
@@ -0,0 +1,54 @@
+/*! \file
+ * Declarations for binary traces of allocations and deallocations, which the
+ * memory-allocator tester can write out from a sequence and replay straight
+ * from the file, however long they are.
+ *
+ * A trace starts with a TRACE_HEADER, followed by one record per operation.
+ * Each object is named by a number, and each record is a tag, a varint of
+ * the zigzag-encoded difference between its object's number and that of the
+ * previous record, shifted left past a two-bit op code.  An allocate or a
+ * reallocate continues with a varint of the zigzag-encoded difference
+ * between its size and the size in the previous such record.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct sequence_struct;
+
+#define TRACE_MAGIC "MYTRACE1"
+
+// op codes in the low bits of each record's tag
+#define TRACE_ALLOC 0
+#define TRACE_FREE 1
+#define TRACE_REALLOC 2
+
+// the longest a record can be: a tag and a size, of ten bytes at most each
+#define TRACE_RECORD_MAX 20
+
+typedef struct trace_header {
+  char magic[8];
+  uint64_t ops;          // records in the trace
+  uint64_t objects;      // one more than the highest object number
+  uint64_t peak_bytes;   // the most bytes live at once
+  uint64_t total_bytes;  // the bytes of every allocation together
+} TRACE_HEADER;
+
+typedef struct trace {
+  unsigned char *data;   // the whole file, mapped
+  size_t length;
+  TRACE_HEADER header;
+  long corrupted;        // objects whose data changed in the last replay
+} TRACE;
+
+// encode one record into buffer, which has room for TRACE_RECORD_MAX bytes,
+// and return its length; the size delta is left out of frees
+int trace_record(unsigned char *buffer, int op, int64_t id_delta,
+                 int64_t size_delta);
+// write a sequence (a SEQLIST) out as a trace; returns 0 if that fails
+int trace_write(struct sequence_struct *seq, const char *path);
+// map a trace for replaying; returns 0 if it cannot be read
+TRACE *trace_open(const char *path);
+// replay a trace against a fresh pool of mem_size bytes, like try_sequence()
+int trace_replay(TRACE *trace, size_t mem_size);
+void trace_close(TRACE *trace);
@@ -20,7 +20,7 @@
  * init_myalloc(), and then myalloc() and free() work against this pool of
  * memory that mem points to.
  */
-int MEMORY_SIZE;
+size_t MEMORY_SIZE;
 unsigned char *mem;
 
 
@@ -53,7 +53,7 @@ void init_myalloc() {
     mem = (unsigned char *) malloc(MEMORY_SIZE);
     if (mem == 0) {
         fprintf(stderr,
-                "init_myalloc: could not get %d bytes from the system\n",
+                "init_myalloc: could not get %zu bytes from the system\n",
 		MEMORY_SIZE);
         abort();
     }
@@ -67,7 +67,7 @@ void init_myalloc() {
  * Attempt to allocate a chunk of memory of "size" bytes.  Return 0 if
  * allocation fails.
  */
-unsigned char *myalloc(int size) {
+unsigned char *myalloc(size_t size) {
 
     /* TODO:  The unacceptable allocator simply checks to see if there are at
      *        least "size" bytes left in the pool, and if so, the caller gets
@@ -82,7 +82,7 @@ unsigned char *myalloc(int size) {
         return resultptr;
     }
     else {
-        fprintf(stderr, "myalloc: cannot service request of size %d with"
+        fprintf(stderr, "myalloc: cannot service request of size %zu with"
                 " %lx bytes allocated\n", size, (freeptr - mem));
         return (unsigned char *) 0;
     }
@@ -103,6 +103,22 @@ void myfree(unsigned char *oldptr) {
      */
 }
 
+/*!
+ * Every request is served from the pool here, so there is nothing to turn
+ * off.
+ */
+void myalloc_set_mmap_threshold(size_t threshold) {
+}
+
+/*!
+ * Return the smallest MEMORY_SIZE that would have served every request made
+ * since init_myalloc().  Nothing is ever reused, so that is just how far the
+ * free-pointer has moved, and one more byte for the check in myalloc().
+ */
+size_t myalloc_required_memory() {
+    return freeptr - mem + 1;
+}
+
 /*!
  * Clean up the allocator state.
  * All this really has to do is free the user memory pool. This function mostly